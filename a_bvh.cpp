@@ -0,0 +1,1618 @@
+#include "a_bvh.h"
+#include "a_thread_pool.h"
+
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+uint32_t const kBvhBinCount = 16;
+uint32_t const kBvhMaxLeafSize = 8;
+uint32_t const kBvhMaxDepth = 64;
+uint32_t const kBvhMinSubtreeSize = 4096; // smaller nodes are not worth binning on several threads
+uint32_t const kBvhSubtreesPerThread = 4;
+float const kBvhTraversalCost = 1.f;
+float const kBvhIntersectionCost = 1.f;
+
+thread_local bool bvh_count_node_fetches = false;
+thread_local uint64_t bvh_node_fetch_count = 0;
+
+struct BvhBin
+{
+	Aabb bounds;
+	uint32_t count;
+};
+
+struct BvhSplit
+{
+	int axis;
+	uint32_t bin; // primitives in bins [0, bin] go to the left child
+	float cost; // unnormalized surface area heuristic
+};
+
+struct BvhBuildTask
+{
+	uint32_t node_index;
+	uint32_t begin;
+	uint32_t end;
+	uint32_t depth;
+};
+
+float bvh_leaf_cost(uint32_t const count, uint32_t const leaf_granularity)
+{
+	return kBvhIntersectionCost * static_cast<float>((count + leaf_granularity - 1) / leaf_granularity);
+}
+
+uint32_t bvh_bin_index(float const centroid, float const min, float const scale)
+{
+	int const bin = static_cast<int>((centroid - min) * scale);
+	return static_cast<uint32_t>(std::min(std::max(bin, 0), static_cast<int>(kBvhBinCount) - 1));
+}
+
+// Primitives are partitioned as references that carry their own bounds, so every pass over a node reads memory in order.
+struct BvhReference
+{
+	Aabb bounds;
+	Vec3 centroid;
+	uint32_t primitive_index;
+};
+
+struct BvhBuilder
+{
+	BvhReference* references;
+	uint32_t leaf_granularity;
+	uint32_t max_leaf_size;
+
+	BvhNode* nodes;
+	std::atomic<uint32_t> node_count;
+};
+
+struct BvhRangeBounds
+{
+	Aabb bounds;
+	Aabb centroid_bounds;
+};
+
+BvhRangeBounds get_bvh_range_bounds(BvhBuilder const& builder, uint32_t const begin, uint32_t const end)
+{
+	BvhRangeBounds range;
+	for (uint32_t i = begin; i < end; ++i)
+	{
+		BvhReference const& reference = builder.references[i];
+		range.bounds = aabb_union(range.bounds, reference.bounds);
+		range.centroid_bounds = aabb_union(range.centroid_bounds, reference.centroid);
+	}
+	return range;
+}
+
+struct BvhBinning
+{
+	BvhBin bins[3][kBvhBinCount];
+};
+
+void clear_bvh_binning(BvhBinning& binning)
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		for (BvhBin& bin : binning.bins[axis])
+		{
+			bin.bounds = Aabb();
+			bin.count = 0;
+		}
+	}
+}
+
+void bin_bvh_range(BvhBuilder const& builder, uint32_t const begin, uint32_t const end, Aabb const centroid_bounds, BvhBinning& binning)
+{
+	float mins[3];
+	float scales[3];
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float const extent = element(centroid_bounds.max, axis) - element(centroid_bounds.min, axis);
+		mins[axis] = element(centroid_bounds.min, axis);
+		scales[axis] = (extent > 0.f) ? static_cast<float>(kBvhBinCount) / extent : 0.f;
+	}
+
+	for (uint32_t i = begin; i < end; ++i)
+	{
+		BvhReference const& reference = builder.references[i];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			BvhBin& bin = binning.bins[axis][bvh_bin_index(element(reference.centroid, axis), mins[axis], scales[axis])];
+			bin.bounds = aabb_union(bin.bounds, reference.bounds);
+			bin.count++;
+		}
+	}
+}
+
+BvhSplit find_bvh_split(BvhBinning const& binning, Aabb const centroid_bounds, uint32_t const leaf_granularity)
+{
+	BvhSplit best_split;
+	best_split.axis = -1;
+	best_split.bin = 0;
+	best_split.cost = FLT_MAX;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (element(centroid_bounds.max, axis) - element(centroid_bounds.min, axis) <= 0.f)
+			continue;
+		BvhBin const* const bins = binning.bins[axis];
+
+		// Sweep from the right to find the cost of every right-hand side, then from the left to evaluate each plane.
+		float right_area[kBvhBinCount];
+		uint32_t right_count[kBvhBinCount];
+		Aabb right_bounds;
+		uint32_t count = 0;
+		for (uint32_t bin_index = kBvhBinCount - 1; bin_index > 0; --bin_index)
+		{
+			right_bounds = aabb_union(right_bounds, bins[bin_index].bounds);
+			count += bins[bin_index].count;
+			right_area[bin_index] = aabb_surface_area(right_bounds);
+			right_count[bin_index] = count;
+		}
+
+		Aabb left_bounds;
+		count = 0;
+		for (uint32_t bin_index = 0; bin_index < kBvhBinCount - 1; ++bin_index)
+		{
+			left_bounds = aabb_union(left_bounds, bins[bin_index].bounds);
+			count += bins[bin_index].count;
+			if (!count || !right_count[bin_index + 1])
+				continue;
+
+			float const cost = bvh_leaf_cost(count, leaf_granularity) * aabb_surface_area(left_bounds) + bvh_leaf_cost(right_count[bin_index + 1], leaf_granularity) * right_area[bin_index + 1];
+			if (cost < best_split.cost)
+			{
+				best_split.axis = axis;
+				best_split.bin = bin_index;
+				best_split.cost = cost;
+			}
+		}
+	}
+
+	return best_split;
+}
+
+// Split [begin, end) between the pool's threads, or leave all of it to the calling thread without a pool.
+void run_bvh_chunks(ThreadPool* const pool, uint32_t const begin, uint32_t const end, std::function<void(uint32_t, uint32_t, uint32_t)> const& function)
+{
+	if (pool)
+		run_thread_pool_chunks(*pool, begin, end, function);
+	else
+		function(0, begin, end);
+}
+
+// Fill in the task's node and, unless it becomes a leaf, partition its primitives and return the tasks for its two children.
+// Bounds and bins are gathered on the pool's threads, which only pays off for the large nodes at the top of the tree.
+bool split_bvh_node(BvhBuilder& builder, BvhBuildTask const& task, ThreadPool* const pool, BvhBuildTask* const child_tasks)
+{
+	uint32_t const thread_count = (pool) ? thread_pool_size(*pool) : 1;
+	uint32_t const begin = task.begin;
+	uint32_t const end = task.end;
+	uint32_t const count = end - begin;
+
+	BvhRangeBounds range;
+	if (thread_count > 1)
+	{
+		std::vector<BvhRangeBounds> chunk_ranges(thread_count);
+		run_thread_pool_chunks(*pool, begin, end, [&](uint32_t const chunk_index, uint32_t const chunk_begin, uint32_t const chunk_end)
+		{
+			chunk_ranges[chunk_index] = get_bvh_range_bounds(builder, chunk_begin, chunk_end);
+		});
+		for (BvhRangeBounds const& chunk_range : chunk_ranges)
+		{
+			range.bounds = aabb_union(range.bounds, chunk_range.bounds);
+			range.centroid_bounds = aabb_union(range.centroid_bounds, chunk_range.centroid_bounds);
+		}
+	}
+	else
+	{
+		range = get_bvh_range_bounds(builder, begin, end);
+	}
+
+	BvhNode& node = builder.nodes[task.node_index];
+	node.bounds = range.bounds;
+	node.index = begin;
+	node.count = count;
+
+	if (count == 1 || task.depth + 1 >= kBvhMaxDepth)
+		return false;
+
+	BvhBinning binning;
+	clear_bvh_binning(binning);
+	if (thread_count > 1)
+	{
+		std::vector<BvhBinning> chunk_binnings(thread_count);
+		run_thread_pool_chunks(*pool, begin, end, [&](uint32_t const chunk_index, uint32_t const chunk_begin, uint32_t const chunk_end)
+		{
+			clear_bvh_binning(chunk_binnings[chunk_index]);
+			bin_bvh_range(builder, chunk_begin, chunk_end, range.centroid_bounds, chunk_binnings[chunk_index]);
+		});
+		for (BvhBinning const& chunk_binning : chunk_binnings)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				for (uint32_t bin_index = 0; bin_index < kBvhBinCount; ++bin_index)
+				{
+					BvhBin& bin = binning.bins[axis][bin_index];
+					bin.bounds = aabb_union(bin.bounds, chunk_binning.bins[axis][bin_index].bounds);
+					bin.count += chunk_binning.bins[axis][bin_index].count;
+				}
+			}
+		}
+	}
+	else
+	{
+		bin_bvh_range(builder, begin, end, range.centroid_bounds, binning);
+	}
+
+	BvhSplit const split = find_bvh_split(binning, range.centroid_bounds, builder.leaf_granularity);
+
+	uint32_t middle = begin;
+	if (split.axis >= 0)
+	{
+		float const leaf_cost = bvh_leaf_cost(count, builder.leaf_granularity);
+		float const split_cost = kBvhTraversalCost + split.cost / aabb_surface_area(range.bounds);
+		if (count <= builder.max_leaf_size && leaf_cost <= split_cost)
+			return false;
+
+		int const axis = split.axis;
+		float const min = element(range.centroid_bounds.min, axis);
+		float const scale = static_cast<float>(kBvhBinCount) / (element(range.centroid_bounds.max, axis) - min);
+		BvhReference* const references = builder.references;
+		middle = static_cast<uint32_t>(std::partition(references + begin, references + end, [&](BvhReference const& reference)
+		{
+			return bvh_bin_index(element(reference.centroid, axis), min, scale) <= split.bin;
+		}) - references);
+	}
+	else
+	{
+		// Every centroid is in the same place, so there is nothing to gain from a split other than a smaller leaf.
+		if (count <= builder.max_leaf_size)
+			return false;
+		middle = begin + count / 2;
+	}
+
+	uint32_t const child_index = builder.node_count.fetch_add(2);
+	node.index = child_index;
+	node.count = 0;
+
+	child_tasks[0] = {child_index + 0, begin, middle, task.depth + 1};
+	child_tasks[1] = {child_index + 1, middle, end, task.depth + 1};
+	return true;
+}
+
+void build_bvh_subtree(BvhBuilder& builder, BvhBuildTask const& root_task)
+{
+	std::vector<BvhBuildTask> tasks;
+	tasks.push_back(root_task);
+
+	while (!tasks.empty())
+	{
+		BvhBuildTask const task = tasks.back();
+		tasks.pop_back();
+
+		BvhBuildTask child_tasks[2];
+		if (split_bvh_node(builder, task, nullptr, child_tasks))
+		{
+			tasks.push_back(child_tasks[1]);
+			tasks.push_back(child_tasks[0]);
+		}
+	}
+}
+
+Bvh build_bvh(uint32_t const primitive_count, Aabb const* const primitive_bounds, uint32_t const leaf_granularity, ThreadPool* const pool)
+{
+	Bvh bvh = {};
+	if (!primitive_count)
+		return bvh;
+
+	std::vector<BvhReference> references(primitive_count);
+	run_bvh_chunks(pool, 0, primitive_count, [&](uint32_t, uint32_t const chunk_begin, uint32_t const chunk_end)
+	{
+		for (uint32_t primitive_index = chunk_begin; primitive_index < chunk_end; ++primitive_index)
+		{
+			BvhReference& reference = references[primitive_index];
+			reference.bounds = primitive_bounds[primitive_index];
+			reference.centroid = aabb_centroid(primitive_bounds[primitive_index]);
+			reference.primitive_index = primitive_index;
+		}
+	});
+
+	BvhBuilder builder;
+	builder.references = references.data();
+	builder.leaf_granularity = leaf_granularity;
+	builder.max_leaf_size = std::max(kBvhMaxLeafSize, leaf_granularity);
+	builder.nodes = new BvhNode[2 * primitive_count - 1];
+	builder.node_count = 1;
+
+	// Split the top of the tree one node at a time with every thread working on it, until there are enough
+	// subtrees for each thread to build its own.
+	uint32_t const thread_count = (pool) ? thread_pool_size(*pool) : 1;
+	uint32_t const subtree_size = std::max(kBvhMinSubtreeSize, primitive_count / (kBvhSubtreesPerThread * thread_count));
+	std::vector<BvhBuildTask> subtree_tasks;
+	std::vector<BvhBuildTask> tasks;
+	tasks.push_back({0, 0, primitive_count, 0});
+	while (!tasks.empty())
+	{
+		BvhBuildTask const task = tasks.back();
+		tasks.pop_back();
+
+		if (thread_count <= 1 || task.end - task.begin < subtree_size)
+		{
+			subtree_tasks.push_back(task);
+			continue;
+		}
+
+		BvhBuildTask child_tasks[2];
+		if (split_bvh_node(builder, task, pool, child_tasks))
+		{
+			tasks.push_back(child_tasks[1]);
+			tasks.push_back(child_tasks[0]);
+		}
+	}
+
+	// Hand out the largest subtrees first so the threads run out of work at about the same time.
+	std::sort(subtree_tasks.begin(), subtree_tasks.end(), [](BvhBuildTask const& a, BvhBuildTask const& b)
+	{
+		return a.end - a.begin > b.end - b.begin;
+	});
+
+	std::atomic<uint32_t> next_subtree(0);
+	uint32_t const subtree_count = static_cast<uint32_t>(subtree_tasks.size());
+	run_bvh_chunks(pool, 0, subtree_count, [&](uint32_t, uint32_t, uint32_t)
+	{
+		for (uint32_t subtree_index = next_subtree++; subtree_index < subtree_count; subtree_index = next_subtree++)
+		{
+			build_bvh_subtree(builder, subtree_tasks[subtree_index]);
+		}
+	});
+
+	uint32_t* const primitive_indices = new uint32_t[primitive_count];
+	for (uint32_t i = 0; i < primitive_count; ++i)
+	{
+		primitive_indices[i] = references[i].primitive_index;
+	}
+
+	uint32_t const node_count = builder.node_count;
+	BvhNode* const bvh_nodes = new BvhNode[node_count];
+	std::copy(builder.nodes, builder.nodes + node_count, bvh_nodes);
+	delete[] builder.nodes;
+
+	bvh.node_count = node_count;
+	bvh.primitive_count = primitive_count;
+	bvh.nodes = bvh_nodes;
+	bvh.primitive_indices = primitive_indices;
+	return bvh;
+}
+
+Aabb get_triangle_bounds(uint32_t const triangle_index, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	uint32_t const base_index = 3u * triangle_index;
+
+	Aabb bounds;
+	bounds = aabb_union(bounds, vertices[indices[base_index + 0]]);
+	bounds = aabb_union(bounds, vertices[indices[base_index + 1]]);
+	bounds = aabb_union(bounds, vertices[indices[base_index + 2]]);
+	return bounds;
+}
+
+Bvh build_triangle_bvh(uint32_t const triangle_count, uint32_t const* const indices, Vec3 const* const vertices, uint32_t const leaf_granularity, ThreadPool* const pool)
+{
+	std::vector<Aabb> triangle_bounds(triangle_count);
+	run_bvh_chunks(pool, 0, triangle_count, [&](uint32_t, uint32_t const chunk_begin, uint32_t const chunk_end)
+	{
+		for (uint32_t triangle_index = chunk_begin; triangle_index < chunk_end; ++triangle_index)
+		{
+			triangle_bounds[triangle_index] = get_triangle_bounds(triangle_index, indices, vertices);
+		}
+	});
+
+	return build_bvh(triangle_count, triangle_bounds.data(), leaf_granularity, pool);
+}
+
+uint32_t const kSbvhSpatialBinCount = 32;
+float const kSbvhOverlapThreshold = 1e-5f; // fraction of the root surface area
+
+struct SbvhBuilder
+{
+	uint32_t const* indices;
+	Vec3 const* vertices;
+	uint32_t leaf_granularity;
+	uint32_t max_leaf_size;
+	uint32_t reference_count;
+	uint32_t max_reference_count;
+	float min_overlap_area; // object splits whose children overlap less than this are not worth a spatial split
+};
+
+struct SbvhBuildTask
+{
+	uint32_t node_index;
+	uint32_t depth;
+	std::vector<BvhReference> references;
+};
+
+struct SbvhBin
+{
+	Aabb bounds;
+	uint32_t entry_count;
+	uint32_t exit_count;
+};
+
+struct SbvhSpatialSplit
+{
+	int axis;
+	float position;
+	float cost; // unnormalized surface area heuristic
+	Aabb left_bounds;
+	Aabb right_bounds;
+	uint32_t left_count; // references that start left of the plane
+	uint32_t right_count; // references that end right of the plane
+};
+
+uint32_t sbvh_bin_index(float const position, float const min, float const scale)
+{
+	int const bin = static_cast<int>((position - min) * scale);
+	return static_cast<uint32_t>(std::min(std::max(bin, 0), static_cast<int>(kSbvhSpatialBinCount) - 1));
+}
+
+// Bounds of the part of a triangle that lies between two planes perpendicular to axis.
+Aabb clip_triangle_bounds(SbvhBuilder const& builder, uint32_t const triangle_index, int const axis, float const min, float const max)
+{
+	uint32_t const base_index = 3u * triangle_index;
+	Vec3 const points[3] =
+	{
+		builder.vertices[builder.indices[base_index + 0]],
+		builder.vertices[builder.indices[base_index + 1]],
+		builder.vertices[builder.indices[base_index + 2]],
+	};
+	float const planes[2] = {min, max};
+
+	Aabb bounds;
+	for (int i = 0; i < 3; ++i)
+	{
+		Vec3 const a = points[i];
+		Vec3 const b = points[(i + 1) % 3];
+		float const a_axis = element(a, axis);
+		float const b_axis = element(b, axis);
+		if (a_axis >= min && a_axis <= max)
+			bounds = aabb_union(bounds, a);
+
+		for (float const plane : planes)
+		{
+			if ((a_axis < plane && plane < b_axis) || (b_axis < plane && plane < a_axis))
+				bounds = aabb_union(bounds, a + (b - a) * ((plane - a_axis) / (b_axis - a_axis)));
+		}
+	}
+	return bounds;
+}
+
+// Split a reference at a plane, clipping its triangle so each half is as tight as the original allows.
+void split_sbvh_reference(SbvhBuilder const& builder, BvhReference const& reference, int const axis, float const position, BvhReference& left, BvhReference& right)
+{
+	left = reference;
+	right = reference;
+	left.bounds = aabb_intersection(clip_triangle_bounds(builder, reference.primitive_index, axis, -FLT_MAX, position), reference.bounds);
+	right.bounds = aabb_intersection(clip_triangle_bounds(builder, reference.primitive_index, axis, position, FLT_MAX), reference.bounds);
+	left.centroid = aabb_centroid(left.bounds);
+	right.centroid = aabb_centroid(right.bounds);
+}
+
+SbvhSpatialSplit find_sbvh_spatial_split(SbvhBuilder const& builder, std::vector<BvhReference> const& references, Aabb const bounds)
+{
+	SbvhSpatialSplit best_split;
+	best_split.axis = -1;
+	best_split.position = 0.f;
+	best_split.cost = FLT_MAX;
+	best_split.left_count = 0;
+	best_split.right_count = 0;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float const min = element(bounds.min, axis);
+		float const extent = element(bounds.max, axis) - min;
+		if (extent <= 0.f)
+			continue;
+		float const bin_width = extent / static_cast<float>(kSbvhSpatialBinCount);
+		float const scale = 1.f / bin_width;
+
+		SbvhBin bins[kSbvhSpatialBinCount];
+		for (SbvhBin& bin : bins)
+		{
+			bin.bounds = Aabb();
+			bin.entry_count = 0;
+			bin.exit_count = 0;
+		}
+
+		// Every reference adds the piece of its triangle inside each bin it crosses, but is only counted where it starts and ends.
+		for (BvhReference const& reference : references)
+		{
+			uint32_t const first_bin = sbvh_bin_index(element(reference.bounds.min, axis), min, scale);
+			uint32_t const last_bin = std::max(first_bin, sbvh_bin_index(element(reference.bounds.max, axis), min, scale));
+			for (uint32_t bin_index = first_bin; bin_index <= last_bin; ++bin_index)
+			{
+				Aabb piece = reference.bounds;
+				if (first_bin != last_bin)
+				{
+					float const bin_min = min + bin_index * bin_width;
+					float const bin_max = (bin_index + 1 == kSbvhSpatialBinCount) ? element(bounds.max, axis) : bin_min + bin_width;
+					piece = aabb_intersection(clip_triangle_bounds(builder, reference.primitive_index, axis, bin_min, bin_max), reference.bounds);
+				}
+				if (!aabb_is_empty(piece))
+					bins[bin_index].bounds = aabb_union(bins[bin_index].bounds, piece);
+			}
+			bins[first_bin].entry_count++;
+			bins[last_bin].exit_count++;
+		}
+
+		Aabb right_bounds[kSbvhSpatialBinCount];
+		uint32_t right_count[kSbvhSpatialBinCount];
+		Aabb bounds_sum;
+		uint32_t count = 0;
+		for (uint32_t bin_index = kSbvhSpatialBinCount - 1; bin_index > 0; --bin_index)
+		{
+			bounds_sum = aabb_union(bounds_sum, bins[bin_index].bounds);
+			count += bins[bin_index].exit_count;
+			right_bounds[bin_index] = bounds_sum;
+			right_count[bin_index] = count;
+		}
+
+		Aabb left_bounds;
+		count = 0;
+		for (uint32_t bin_index = 0; bin_index < kSbvhSpatialBinCount - 1; ++bin_index)
+		{
+			left_bounds = aabb_union(left_bounds, bins[bin_index].bounds);
+			count += bins[bin_index].entry_count;
+			if (!count || !right_count[bin_index + 1])
+				continue;
+
+			float const cost = bvh_leaf_cost(count, builder.leaf_granularity) * aabb_surface_area(left_bounds)
+				+ bvh_leaf_cost(right_count[bin_index + 1], builder.leaf_granularity) * aabb_surface_area(right_bounds[bin_index + 1]);
+			if (cost < best_split.cost)
+			{
+				best_split.axis = axis;
+				best_split.position = min + (bin_index + 1) * bin_width;
+				best_split.cost = cost;
+				best_split.left_bounds = left_bounds;
+				best_split.right_bounds = right_bounds[bin_index + 1];
+				best_split.left_count = count;
+				best_split.right_count = right_count[bin_index + 1];
+			}
+		}
+	}
+
+	return best_split;
+}
+
+void partition_sbvh_spatial_split(SbvhBuilder& builder, std::vector<BvhReference> const& references, SbvhSpatialSplit const& split,
+	std::vector<BvhReference>& left, std::vector<BvhReference>& right)
+{
+	int const axis = split.axis;
+	Aabb left_bounds = split.left_bounds;
+	Aabb right_bounds = split.right_bounds;
+	float left_count = static_cast<float>(split.left_count);
+	float right_count = static_cast<float>(split.right_count);
+
+	for (BvhReference const& reference : references)
+	{
+		if (element(reference.bounds.max, axis) <= split.position)
+		{
+			left.push_back(reference);
+		}
+		else if (element(reference.bounds.min, axis) >= split.position)
+		{
+			right.push_back(reference);
+		}
+		else
+		{
+			// A straddling reference stays whole on one side when that is cheaper than duplicating it, or when the budget is spent.
+			float const left_area = aabb_surface_area(left_bounds);
+			float const right_area = aabb_surface_area(right_bounds);
+			float const duplicate_cost = left_area * left_count + right_area * right_count;
+			float const left_cost = aabb_surface_area(aabb_union(left_bounds, reference.bounds)) * left_count + right_area * (right_count - 1.f);
+			float const right_cost = left_area * (left_count - 1.f) + aabb_surface_area(aabb_union(right_bounds, reference.bounds)) * right_count;
+
+			bool const can_duplicate = builder.reference_count < builder.max_reference_count;
+			if (can_duplicate && duplicate_cost < left_cost && duplicate_cost < right_cost)
+			{
+				BvhReference left_reference;
+				BvhReference right_reference;
+				split_sbvh_reference(builder, reference, axis, split.position, left_reference, right_reference);
+				if (!aabb_is_empty(left_reference.bounds) && !aabb_is_empty(right_reference.bounds))
+				{
+					left.push_back(left_reference);
+					right.push_back(right_reference);
+					builder.reference_count++;
+					continue;
+				}
+			}
+
+			if (left_cost <= right_cost)
+			{
+				left.push_back(reference);
+				left_bounds = aabb_union(left_bounds, reference.bounds);
+				right_count -= 1.f;
+			}
+			else
+			{
+				right.push_back(reference);
+				right_bounds = aabb_union(right_bounds, reference.bounds);
+				left_count -= 1.f;
+			}
+		}
+	}
+}
+
+Bvh build_triangle_sbvh(uint32_t const triangle_count, uint32_t const* const indices, Vec3 const* const vertices, uint32_t const leaf_granularity, float const reference_budget)
+{
+	Bvh bvh = {};
+	if (!triangle_count)
+		return bvh;
+
+	SbvhBuilder builder;
+	builder.indices = indices;
+	builder.vertices = vertices;
+	builder.leaf_granularity = leaf_granularity;
+	builder.max_leaf_size = std::max(kBvhMaxLeafSize, leaf_granularity);
+	builder.reference_count = triangle_count;
+	builder.max_reference_count = std::max(triangle_count, static_cast<uint32_t>(triangle_count * reference_budget));
+
+	SbvhBuildTask root_task;
+	root_task.node_index = 0;
+	root_task.depth = 0;
+	root_task.references.resize(triangle_count);
+	Aabb root_bounds;
+	for (uint32_t triangle_index = 0; triangle_index < triangle_count; ++triangle_index)
+	{
+		uint32_t const base_index = 3u * triangle_index;
+
+		BvhReference& reference = root_task.references[triangle_index];
+		reference.bounds = Aabb();
+		reference.bounds = aabb_union(reference.bounds, vertices[indices[base_index + 0]]);
+		reference.bounds = aabb_union(reference.bounds, vertices[indices[base_index + 1]]);
+		reference.bounds = aabb_union(reference.bounds, vertices[indices[base_index + 2]]);
+		reference.centroid = aabb_centroid(reference.bounds);
+		reference.primitive_index = triangle_index;
+		root_bounds = aabb_union(root_bounds, reference.bounds);
+	}
+	builder.min_overlap_area = kSbvhOverlapThreshold * aabb_surface_area(root_bounds);
+
+	std::vector<BvhNode> nodes;
+	nodes.push_back(BvhNode());
+	std::vector<uint32_t> primitive_indices;
+	primitive_indices.reserve(builder.max_reference_count);
+
+	std::vector<SbvhBuildTask> tasks;
+	tasks.push_back(std::move(root_task));
+
+	while (!tasks.empty())
+	{
+		SbvhBuildTask task = std::move(tasks.back());
+		tasks.pop_back();
+
+		std::vector<BvhReference> const& references = task.references;
+		uint32_t const count = static_cast<uint32_t>(references.size());
+
+		// The object split reuses the binned SAH helpers on this node's own references.
+		BvhBuilder object_builder;
+		object_builder.references = task.references.data();
+		object_builder.leaf_granularity = leaf_granularity;
+		object_builder.max_leaf_size = builder.max_leaf_size;
+
+		BvhRangeBounds const range = get_bvh_range_bounds(object_builder, 0, count);
+		nodes[task.node_index].bounds = range.bounds;
+
+		std::vector<BvhReference> left;
+		std::vector<BvhReference> right;
+		if (count > 1 && task.depth + 1 < kBvhMaxDepth)
+		{
+			BvhBinning binning;
+			clear_bvh_binning(binning);
+			bin_bvh_range(object_builder, 0, count, range.centroid_bounds, binning);
+			BvhSplit const object_split = find_bvh_split(binning, range.centroid_bounds, leaf_granularity);
+
+			// Only look for a spatial split where the children of the object split overlap noticeably.
+			SbvhSpatialSplit spatial_split;
+			spatial_split.axis = -1;
+			spatial_split.cost = FLT_MAX;
+			bool try_spatial_split = object_split.axis < 0;
+			if (!try_spatial_split)
+			{
+				Aabb object_left_bounds;
+				Aabb object_right_bounds;
+				for (uint32_t bin_index = 0; bin_index < kBvhBinCount; ++bin_index)
+				{
+					Aabb& side_bounds = (bin_index <= object_split.bin) ? object_left_bounds : object_right_bounds;
+					side_bounds = aabb_union(side_bounds, binning.bins[object_split.axis][bin_index].bounds);
+				}
+				try_spatial_split = aabb_surface_area(aabb_intersection(object_left_bounds, object_right_bounds)) > builder.min_overlap_area;
+			}
+			if (try_spatial_split)
+				spatial_split = find_sbvh_spatial_split(builder, references, range.bounds);
+
+			float const split_cost = kBvhTraversalCost + std::min(object_split.cost, spatial_split.cost) / aabb_surface_area(range.bounds);
+			bool const make_leaf = count <= builder.max_leaf_size && bvh_leaf_cost(count, leaf_granularity) <= split_cost;
+
+			if (!make_leaf && spatial_split.cost < object_split.cost)
+			{
+				partition_sbvh_spatial_split(builder, references, spatial_split, left, right);
+				if (left.empty() || right.empty())
+				{
+					left.clear();
+					right.clear();
+				}
+			}
+
+			if (!make_leaf && left.empty())
+			{
+				if (object_split.axis >= 0)
+				{
+					int const axis = object_split.axis;
+					float const min = element(range.centroid_bounds.min, axis);
+					float const scale = static_cast<float>(kBvhBinCount) / (element(range.centroid_bounds.max, axis) - min);
+					for (BvhReference const& reference : references)
+					{
+						std::vector<BvhReference>& side = (bvh_bin_index(element(reference.centroid, axis), min, scale) <= object_split.bin) ? left : right;
+						side.push_back(reference);
+					}
+				}
+				else if (count > builder.max_leaf_size)
+				{
+					// Every centroid is in the same place and no spatial split helps, so just make the leaf smaller.
+					left.assign(references.begin(), references.begin() + count / 2);
+					right.assign(references.begin() + count / 2, references.end());
+				}
+			}
+		}
+
+		if (left.empty())
+		{
+			BvhNode& node = nodes[task.node_index];
+			node.index = static_cast<uint32_t>(primitive_indices.size());
+			node.count = count;
+			for (BvhReference const& reference : references)
+			{
+				primitive_indices.push_back(reference.primitive_index);
+			}
+			continue;
+		}
+
+		uint32_t const child_index = static_cast<uint32_t>(nodes.size());
+		nodes[task.node_index].index = child_index;
+		nodes[task.node_index].count = 0;
+		nodes.push_back(BvhNode());
+		nodes.push_back(BvhNode());
+
+		SbvhBuildTask right_task;
+		right_task.node_index = child_index + 1;
+		right_task.depth = task.depth + 1;
+		right_task.references = std::move(right);
+		tasks.push_back(std::move(right_task));
+
+		SbvhBuildTask left_task;
+		left_task.node_index = child_index + 0;
+		left_task.depth = task.depth + 1;
+		left_task.references = std::move(left);
+		tasks.push_back(std::move(left_task));
+	}
+
+	BvhNode* const bvh_nodes = new BvhNode[nodes.size()];
+	std::copy(nodes.begin(), nodes.end(), bvh_nodes);
+	uint32_t* const bvh_primitive_indices = new uint32_t[primitive_indices.size()];
+	std::copy(primitive_indices.begin(), primitive_indices.end(), bvh_primitive_indices);
+
+	bvh.node_count = static_cast<uint32_t>(nodes.size());
+	bvh.primitive_count = static_cast<uint32_t>(primitive_indices.size());
+	bvh.nodes = bvh_nodes;
+	bvh.primitive_indices = bvh_primitive_indices;
+	return bvh;
+}
+
+void build_bvh_triangle_records(Bvh& bvh, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	TriangleRecord* const triangle_records = new TriangleRecord[bvh.primitive_count];
+	for (uint32_t i = 0; i < bvh.primitive_count; ++i)
+	{
+		triangle_records[i] = make_triangle_record(bvh.primitive_indices[i], indices, vertices);
+	}
+	bvh.triangle_records = triangle_records;
+}
+
+void build_bvh_triangle_blocks(Bvh& bvh, uint32_t const simd_width, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	std::vector<TriangleBlock> blocks;
+	uint32_t* const leaf_block_indices = new uint32_t[bvh.node_count];
+
+	for (uint32_t node_index = 0; node_index < bvh.node_count; ++node_index)
+	{
+		BvhNode const& node = bvh.nodes[node_index];
+		leaf_block_indices[node_index] = static_cast<uint32_t>(blocks.size());
+
+		for (uint32_t i = 0; i < node.count; ++i)
+		{
+			if (0 == i % kTriangleBlockSize)
+			{
+				blocks.push_back(TriangleBlock());
+				clear_triangle_block(blocks.back());
+			}
+
+			TriangleBlock& block = blocks.back();
+			uint32_t const triangle_index = bvh.primitive_indices[node.index + i];
+			set_triangle_block_lane(block, block.count++, triangle_index, make_triangle_record(triangle_index, indices, vertices));
+		}
+	}
+
+	TriangleBlock* const triangle_blocks = new TriangleBlock[blocks.size()];
+	std::copy(blocks.begin(), blocks.end(), triangle_blocks);
+
+	bvh.triangle_blocks = triangle_blocks;
+	bvh.leaf_block_indices = leaf_block_indices;
+	bvh.block_count = static_cast<uint32_t>(blocks.size());
+	bvh.simd_width = simd_width;
+}
+
+std::vector<WideBvhNode> collapse_bvh(Bvh const& bvh, uint32_t const width)
+{
+	BvhNode const* const nodes = bvh.nodes;
+	std::vector<WideBvhNode> wide_nodes;
+
+	// Binary nodes whose subtrees are collapsed into wide nodes, in wide node order.
+	std::vector<uint32_t> collapsed_nodes;
+	if (bvh.node_count)
+		collapsed_nodes.push_back(0);
+
+	for (size_t wide_index = 0; wide_index < collapsed_nodes.size(); ++wide_index)
+	{
+		uint32_t const node_index = collapsed_nodes[wide_index];
+
+		uint32_t children[kWideBvhMaxWidth];
+		uint32_t child_count = 0;
+		if (nodes[node_index].count)
+		{
+			children[child_count++] = node_index; // a tree that is a single leaf
+		}
+		else
+		{
+			children[child_count++] = nodes[node_index].index + 0;
+			children[child_count++] = nodes[node_index].index + 1;
+		}
+
+		// Keep opening the largest interior child, the one most likely to be entered, until the node is full.
+		while (child_count < width)
+		{
+			int best_child = -1;
+			float best_area = -1.f;
+			for (uint32_t i = 0; i < child_count; ++i)
+			{
+				BvhNode const& child = nodes[children[i]];
+				float const area = aabb_surface_area(child.bounds);
+				if (!child.count && area > best_area)
+				{
+					best_child = static_cast<int>(i);
+					best_area = area;
+				}
+			}
+			if (best_child < 0)
+				break;
+
+			uint32_t const opened_index = children[best_child];
+			children[best_child] = nodes[opened_index].index + 0;
+			children[child_count++] = nodes[opened_index].index + 1;
+		}
+
+		WideBvhNode wide_node;
+		for (uint32_t lane = 0; lane < kWideBvhMaxWidth; ++lane)
+		{
+			Aabb const bounds = (lane < child_count) ? nodes[children[lane]].bounds : Aabb();
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				wide_node.min[axis][lane] = element(bounds.min, axis);
+				wide_node.max[axis][lane] = element(bounds.max, axis);
+			}
+			wide_node.children[lane] = 0;
+		}
+		wide_node.child_count = child_count;
+
+		for (uint32_t lane = 0; lane < child_count; ++lane)
+		{
+			uint32_t const child_index = children[lane];
+			if (nodes[child_index].count)
+			{
+				wide_node.children[lane] = child_index | kWideBvhLeafFlag;
+			}
+			else
+			{
+				wide_node.children[lane] = static_cast<uint32_t>(collapsed_nodes.size());
+				collapsed_nodes.push_back(child_index);
+			}
+		}
+		wide_nodes.push_back(wide_node);
+	}
+	return wide_nodes;
+}
+
+void build_bvh_wide_nodes(Bvh& bvh, uint32_t const width, uint32_t const simd_width)
+{
+	std::vector<WideBvhNode> const wide_nodes = collapse_bvh(bvh, width);
+
+	WideBvhNode* const wide_node_array = new WideBvhNode[wide_nodes.size()];
+	std::copy(wide_nodes.begin(), wide_nodes.end(), wide_node_array);
+
+	bvh.wide_nodes = wide_node_array;
+	bvh.wide_node_count = static_cast<uint32_t>(wide_nodes.size());
+	bvh.wide_width = width;
+	bvh.wide_simd_width = simd_width;
+}
+
+// Largest grid coordinate whose corner is not above value, or smallest one not below it, so decoded boxes always contain the original.
+uint8_t quantize_bvh_bound(float const value, float const origin, float const scale, bool const round_up)
+{
+	if (scale <= 0.f)
+		return 0;
+
+	int q = static_cast<int>((round_up) ? ceilf((value - origin) / scale) : floorf((value - origin) / scale));
+	q = std::min(std::max(q, 0), 255);
+	if (round_up)
+	{
+		while (q < 255 && decode_quantized_bound(origin, scale, q) < value)
+			++q;
+	}
+	else
+	{
+		while (q > 0 && decode_quantized_bound(origin, scale, q) > value)
+			--q;
+	}
+	return static_cast<uint8_t>(q);
+}
+
+void build_bvh_quantized_nodes(Bvh& bvh)
+{
+	std::vector<WideBvhNode> const wide_nodes = collapse_bvh(bvh, kQuantizedBvhWidth);
+	uint32_t const node_count = static_cast<uint32_t>(wide_nodes.size());
+
+	QuantizedBvhNode* const quantized_nodes = static_cast<QuantizedBvhNode*>(allocate_cache_aligned(node_count * sizeof(QuantizedBvhNode)));
+	for (uint32_t node_index = 0; node_index < node_count; ++node_index)
+	{
+		WideBvhNode const& wide_node = wide_nodes[node_index];
+		QuantizedBvhNode& node = quantized_nodes[node_index];
+
+		// The grid spans the union of the children in 255 steps per axis, widened until rounding cannot leave the
+		// last grid line short of the far side.
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float min = FLT_MAX;
+			float max = -FLT_MAX;
+			for (uint32_t lane = 0; lane < wide_node.child_count; ++lane)
+			{
+				min = std::min(min, wide_node.min[axis][lane]);
+				max = std::max(max, wide_node.max[axis][lane]);
+			}
+
+			float scale = 0.f;
+			if (max > min)
+			{
+				float const exact_scale = (max - min) / 255.f;
+				scale = exact_scale;
+				for (float widening = 1e-6f; decode_quantized_bound(min, scale, 255) < max; widening *= 2.f)
+					scale = exact_scale * (1.f + widening);
+			}
+			node.origin[axis] = min;
+			node.scale[axis] = scale;
+		}
+
+		for (uint32_t lane = 0; lane < kQuantizedBvhWidth; ++lane)
+		{
+			bool const used = lane < wide_node.child_count;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				// Unused lanes get an inverted box that no ray can enter.
+				node.min[axis][lane] = (used) ? quantize_bvh_bound(wide_node.min[axis][lane], node.origin[axis], node.scale[axis], false) : 255;
+				node.max[axis][lane] = (used) ? quantize_bvh_bound(wide_node.max[axis][lane], node.origin[axis], node.scale[axis], true) : 0;
+			}
+			node.children[lane] = (used) ? wide_node.children[lane] : 0;
+		}
+	}
+
+	bvh.quantized_nodes = quantized_nodes;
+	bvh.quantized_node_count = node_count;
+}
+
+void refit_triangle_bvh(Bvh& bvh, uint32_t const* const indices, Vec3 const* const vertices, ThreadPool* const pool)
+{
+	uint32_t const node_count = bvh.node_count;
+	if (!node_count)
+		return;
+
+	BvhNode* const nodes = bvh.nodes;
+
+	std::vector<uint32_t> parents(node_count);
+	parents[0] = UINT32_MAX;
+	run_bvh_chunks(pool, 0, node_count, [&](uint32_t, uint32_t const begin, uint32_t const end)
+	{
+		for (uint32_t node_index = begin; node_index < end; ++node_index)
+		{
+			if (!nodes[node_index].count)
+			{
+				parents[nodes[node_index].index + 0] = node_index;
+				parents[nodes[node_index].index + 1] = node_index;
+			}
+		}
+	});
+
+	// Each leaf climbs towards the root; whichever child of an interior node arrives second fits it and keeps climbing.
+	// Leaves of a spatial split BVH get whole triangle bounds, which are looser than the clipped ones but still correct.
+	std::unique_ptr<std::atomic<uint32_t>[]> const arrivals(new std::atomic<uint32_t>[node_count]());
+	run_bvh_chunks(pool, 0, node_count, [&](uint32_t, uint32_t const begin, uint32_t const end)
+	{
+		for (uint32_t node_index = begin; node_index < end; ++node_index)
+		{
+			BvhNode& leaf = nodes[node_index];
+			if (!leaf.count)
+				continue;
+
+			Aabb bounds;
+			for (uint32_t i = 0; i < leaf.count; ++i)
+			{
+				bounds = aabb_union(bounds, get_triangle_bounds(bvh.primitive_indices[leaf.index + i], indices, vertices));
+			}
+			leaf.bounds = bounds;
+
+			uint32_t parent_index = parents[node_index];
+			while (UINT32_MAX != parent_index && 1 == arrivals[parent_index].fetch_add(1, std::memory_order_acq_rel))
+			{
+				BvhNode& parent = nodes[parent_index];
+				parent.bounds = aabb_union(nodes[parent.index + 0].bounds, nodes[parent.index + 1].bounds);
+				parent_index = parents[parent_index];
+			}
+		}
+	});
+
+	if (bvh.triangle_records)
+	{
+		TriangleRecord* const triangle_records = bvh.triangle_records;
+		run_bvh_chunks(pool, 0, bvh.primitive_count, [&](uint32_t, uint32_t const begin, uint32_t const end)
+		{
+			for (uint32_t i = begin; i < end; ++i)
+			{
+				triangle_records[i] = make_triangle_record(bvh.primitive_indices[i], indices, vertices);
+			}
+		});
+	}
+
+	if (bvh.triangle_blocks)
+	{
+		TriangleBlock* const triangle_blocks = bvh.triangle_blocks;
+		run_bvh_chunks(pool, 0, bvh.block_count, [&](uint32_t, uint32_t const begin, uint32_t const end)
+		{
+			for (uint32_t block_index = begin; block_index < end; ++block_index)
+			{
+				TriangleBlock& block = triangle_blocks[block_index];
+				for (uint32_t lane = 0; lane < block.count; ++lane)
+				{
+					uint32_t const triangle_index = block.triangle_index[lane];
+					set_triangle_block_lane(block, lane, triangle_index, make_triangle_record(triangle_index, indices, vertices));
+				}
+			}
+		});
+	}
+
+	// Collapsing again is linear in the nodes and lets the wide layouts follow which children grew the most.
+	if (bvh.wide_nodes)
+	{
+		delete[] bvh.wide_nodes;
+		build_bvh_wide_nodes(bvh, bvh.wide_width, bvh.wide_simd_width);
+	}
+	if (bvh.quantized_nodes)
+	{
+		free_cache_aligned(bvh.quantized_nodes);
+		build_bvh_quantized_nodes(bvh);
+	}
+}
+
+TriangleHit intersect_bvh_leaf(Bvh const& bvh, uint32_t const node_index, Ray const ray, float const t_max, bool const any_hit, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	BvhNode const& node = bvh.nodes[node_index];
+
+	TriangleHit hit;
+	hit.t = t_max;
+
+	if (TriangleBlock const* const triangle_blocks = bvh.triangle_blocks)
+	{
+		TriangleBlock const* const first_block = triangle_blocks + bvh.leaf_block_indices[node_index];
+		uint32_t const block_count = (node.count + kTriangleBlockSize - 1) / kTriangleBlockSize;
+		for (uint32_t block_index = 0; block_index < block_count; ++block_index)
+		{
+			TriangleBlock const& block = first_block[block_index];
+			TriangleHit const block_hit = (8 == bvh.simd_width)
+				? intersect_ray_triangle_block_avx(ray, hit.t, block)
+				: intersect_ray_triangle_block_sse(ray, hit.t, block);
+			if (block_hit.valid())
+			{
+				hit = block_hit;
+				if (any_hit)
+					break;
+			}
+		}
+		return hit;
+	}
+
+	uint32_t const* const primitive_indices = bvh.primitive_indices + node.index;
+	if (TriangleRecord const* const triangle_records = bvh.triangle_records)
+	{
+		for (uint32_t i = 0; i < node.count; ++i)
+		{
+			TriangleHit const tri_hit = intersect_ray_triangle(ray, hit.t, primitive_indices[i], triangle_records[node.index + i]);
+			if (tri_hit.valid())
+			{
+				hit = tri_hit;
+				if (any_hit)
+					break;
+			}
+		}
+	}
+	else
+	{
+		for (uint32_t i = 0; i < node.count; ++i)
+		{
+			TriangleHit const tri_hit = intersect_ray_triangle(ray, hit.t, primitive_indices[i], indices, vertices);
+			if (tri_hit.valid())
+			{
+				hit = tri_hit;
+				if (any_hit)
+					break;
+			}
+		}
+	}
+	return hit;
+}
+
+void free_bvh(Bvh& bvh)
+{
+	delete[] bvh.nodes;
+	delete[] bvh.primitive_indices;
+	delete[] bvh.triangle_records;
+	delete[] bvh.triangle_blocks;
+	delete[] bvh.leaf_block_indices;
+	delete[] bvh.wide_nodes;
+	free_cache_aligned(bvh.quantized_nodes);
+	bvh = Bvh();
+}
+
+float bvh_sah_cost(Bvh const& bvh)
+{
+	if (!bvh.node_count)
+		return 0.f;
+
+	float const root_area = aabb_surface_area(bvh.nodes[0].bounds);
+	if (root_area <= 0.f)
+		return 0.f;
+
+	float cost = 0.f;
+	for (uint32_t node_index = 0; node_index < bvh.node_count; ++node_index)
+	{
+		BvhNode const& node = bvh.nodes[node_index];
+		float const node_cost = (node.count) ? kBvhIntersectionCost * node.count : kBvhTraversalCost;
+		cost += node_cost * aabb_surface_area(node.bounds);
+	}
+	return cost / root_area;
+}
+
+uint32_t bvh_depth(Bvh const& bvh)
+{
+	if (!bvh.node_count)
+		return 0;
+
+	uint32_t max_depth = 0;
+	std::vector<uint32_t> depths(bvh.node_count);
+	depths[0] = 1;
+	for (uint32_t node_index = 0; node_index < bvh.node_count; ++node_index)
+	{
+		BvhNode const& node = bvh.nodes[node_index];
+		uint32_t const depth = depths[node_index];
+		max_depth = std::max(max_depth, depth);
+		if (!node.count)
+		{
+			depths[node.index + 0] = depth + 1;
+			depths[node.index + 1] = depth + 1;
+		}
+	}
+	return max_depth;
+}
+
+float intersect_ray_aabb(Aabb const& box, Vec3 const origin, Vec3 const inv_direction, float const t_max)
+{
+	float const tx0 = (box.min.x - origin.x) * inv_direction.x;
+	float const tx1 = (box.max.x - origin.x) * inv_direction.x;
+	float const ty0 = (box.min.y - origin.y) * inv_direction.y;
+	float const ty1 = (box.max.y - origin.y) * inv_direction.y;
+	float const tz0 = (box.min.z - origin.z) * inv_direction.z;
+	float const tz1 = (box.max.z - origin.z) * inv_direction.z;
+
+	float const t_entry = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), fmaxf(fminf(tz0, tz1), 0.f));
+	float const t_exit = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), fminf(fmaxf(tz0, tz1), t_max));
+	return (t_entry <= t_exit) ? t_entry : FLT_MAX;
+}
+
+struct BvhStackEntry
+{
+	uint32_t node_index;
+	float t_entry;
+};
+
+uint32_t const kWideBvhMaxStackSize = kBvhMaxDepth * (kWideBvhMaxWidth - 1) + 1;
+
+uint32_t intersect_ray_wide_node(Bvh const& bvh, WideBvhNode const& node, Vec3 const origin, Vec3 const inv_direction, float const t_max, float* const t_entries)
+{
+	return (8 == bvh.wide_simd_width)
+		? intersect_ray_wide_node_avx(node, origin, inv_direction, t_max, t_entries)
+		: intersect_ray_wide_node_sse(node, origin, inv_direction, t_max, t_entries);
+}
+
+uint32_t intersect_ray_wide_node(Bvh const&, QuantizedBvhNode const& node, Vec3 const origin, Vec3 const inv_direction, float const t_max, float* const t_entries)
+{
+	return intersect_ray_quantized_node_sse(node, origin, inv_direction, t_max, t_entries);
+}
+
+// The wide traversals run over either node layout.
+
+template <typename Node>
+TriangleHit intersect_wide_bvh(Bvh const& bvh, Node const* const wide_nodes, Ray const ray, float const t_max, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	TriangleHit hit;
+	hit.t = t_max;
+	Vec3 const origin = ray.origin;
+	Vec3 const inv_direction(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+
+	BvhStackEntry stack[kWideBvhMaxStackSize];
+	uint32_t stack_size = 0;
+
+	uint32_t child = 0;
+	for (;;)
+	{
+		if (child & kWideBvhLeafFlag)
+		{
+			COUNT_BVH_NODE_FETCH();
+			TriangleHit const leaf_hit = intersect_bvh_leaf(bvh, child & ~kWideBvhLeafFlag, ray, hit.t, false, indices, vertices);
+			if (leaf_hit.valid())
+			{
+				hit = leaf_hit;
+			}
+		}
+		else
+		{
+			Node const& node = wide_nodes[child];
+			COUNT_BVH_NODE_FETCH();
+			float t_entries[kWideBvhMaxWidth];
+			uint32_t const mask = intersect_ray_wide_node(bvh, node, origin, inv_direction, hit.t, t_entries);
+			if (mask)
+			{
+				// Insert the children farthest first so the nearest one ends up on top.
+				uint32_t const first = stack_size;
+				for (uint32_t lane = 0; lane < kWideBvhMaxWidth; ++lane)
+				{
+					if (!(mask & (1u << lane)))
+						continue;
+
+					uint32_t i = stack_size++;
+					for (; i > first && stack[i - 1].t_entry < t_entries[lane]; --i)
+						stack[i] = stack[i - 1];
+					stack[i].node_index = node.children[lane];
+					stack[i].t_entry = t_entries[lane];
+				}
+				child = stack[--stack_size].node_index;
+				continue;
+			}
+		}
+
+		// Pop the next subtree that can still contain a closer hit.
+		for (;;)
+		{
+			if (!stack_size)
+				return hit;
+			BvhStackEntry const& entry = stack[--stack_size];
+			if (entry.t_entry < hit.t)
+			{
+				child = entry.node_index;
+				break;
+			}
+		}
+	}
+}
+
+template <typename Node>
+bool occluded_wide_bvh(Bvh const& bvh, Node const* const wide_nodes, Ray const ray, float const t_max, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	Vec3 const origin = ray.origin;
+	Vec3 const inv_direction(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+
+	uint32_t stack[kWideBvhMaxStackSize];
+	uint32_t stack_size = 0;
+
+	uint32_t child = 0;
+	for (;;)
+	{
+		if (child & kWideBvhLeafFlag)
+		{
+			COUNT_BVH_NODE_FETCH();
+			if (intersect_bvh_leaf(bvh, child & ~kWideBvhLeafFlag, ray, t_max, true, indices, vertices).valid())
+				return true;
+		}
+		else
+		{
+			Node const& node = wide_nodes[child];
+			COUNT_BVH_NODE_FETCH();
+			float t_entries[kWideBvhMaxWidth];
+			uint32_t const mask = intersect_ray_wide_node(bvh, node, origin, inv_direction, t_max, t_entries);
+			for (uint32_t lane = 0; lane < kWideBvhMaxWidth; ++lane)
+			{
+				if (mask & (1u << lane))
+					stack[stack_size++] = node.children[lane];
+			}
+		}
+
+		if (!stack_size)
+			return false;
+		child = stack[--stack_size];
+	}
+}
+
+TriangleHit intersect_bvh(Bvh const& bvh, Ray const ray, float const t_max, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	TriangleHit hit;
+	hit.t = t_max;
+	if (!bvh.node_count)
+		return hit;
+
+	if (bvh.quantized_nodes)
+		return intersect_wide_bvh(bvh, bvh.quantized_nodes, ray, t_max, indices, vertices);
+	if (bvh.wide_nodes)
+		return intersect_wide_bvh(bvh, bvh.wide_nodes, ray, t_max, indices, vertices);
+
+	BvhNode const* const nodes = bvh.nodes;
+	Vec3 const origin = ray.origin;
+	Vec3 const inv_direction(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+
+	BvhStackEntry stack[kBvhMaxDepth];
+	uint32_t stack_size = 0;
+
+	if (FLT_MAX == intersect_ray_aabb(nodes[0].bounds, origin, inv_direction, hit.t))
+		return hit;
+
+	uint32_t node_index = 0;
+	for (;;)
+	{
+		BvhNode const& node = nodes[node_index];
+		COUNT_BVH_NODE_FETCH();
+		if (node.count)
+		{
+			TriangleHit const leaf_hit = intersect_bvh_leaf(bvh, node_index, ray, hit.t, false, indices, vertices);
+			if (leaf_hit.valid())
+			{
+				hit = leaf_hit;
+			}
+		}
+		else
+		{
+			uint32_t near_index = node.index + 0;
+			uint32_t far_index = node.index + 1;
+			float t_near = intersect_ray_aabb(nodes[near_index].bounds, origin, inv_direction, hit.t);
+			float t_far = intersect_ray_aabb(nodes[far_index].bounds, origin, inv_direction, hit.t);
+			if (t_far < t_near)
+			{
+				std::swap(near_index, far_index);
+				std::swap(t_near, t_far);
+			}
+
+			if (FLT_MAX != t_near)
+			{
+				if (FLT_MAX != t_far)
+				{
+					stack[stack_size].node_index = far_index;
+					stack[stack_size].t_entry = t_far;
+					stack_size++;
+				}
+				node_index = near_index;
+				continue;
+			}
+		}
+
+		// Pop the next subtree that can still contain a closer hit.
+		for (;;)
+		{
+			if (!stack_size)
+				return hit;
+			BvhStackEntry const& entry = stack[--stack_size];
+			if (entry.t_entry < hit.t)
+			{
+				node_index = entry.node_index;
+				break;
+			}
+		}
+	}
+}
+
+bool occluded_bvh(Bvh const& bvh, Ray const ray, float const t_max, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	if (!bvh.node_count)
+		return false;
+
+	if (bvh.quantized_nodes)
+		return occluded_wide_bvh(bvh, bvh.quantized_nodes, ray, t_max, indices, vertices);
+	if (bvh.wide_nodes)
+		return occluded_wide_bvh(bvh, bvh.wide_nodes, ray, t_max, indices, vertices);
+
+	BvhNode const* const nodes = bvh.nodes;
+	Vec3 const origin = ray.origin;
+	Vec3 const inv_direction(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+
+	uint32_t stack[kBvhMaxDepth];
+	uint32_t stack_size = 0;
+
+	if (FLT_MAX == intersect_ray_aabb(nodes[0].bounds, origin, inv_direction, t_max))
+		return false;
+
+	// Any hit will do, so children are visited in memory order and the first one found ends the query.
+	uint32_t node_index = 0;
+	for (;;)
+	{
+		BvhNode const& node = nodes[node_index];
+		COUNT_BVH_NODE_FETCH();
+		if (node.count)
+		{
+			if (intersect_bvh_leaf(bvh, node_index, ray, t_max, true, indices, vertices).valid())
+				return true;
+		}
+		else
+		{
+			bool const hit_left = FLT_MAX != intersect_ray_aabb(nodes[node.index + 0].bounds, origin, inv_direction, t_max);
+			bool const hit_right = FLT_MAX != intersect_ray_aabb(nodes[node.index + 1].bounds, origin, inv_direction, t_max);
+			if (hit_left)
+			{
+				if (hit_right)
+					stack[stack_size++] = node.index + 1;
+				node_index = node.index + 0;
+				continue;
+			}
+			if (hit_right)
+			{
+				node_index = node.index + 1;
+				continue;
+			}
+		}
+
+		if (!stack_size)
+			return false;
+		node_index = stack[--stack_size];
+	}
+}
+
+RayPacket make_ray_packet(Ray const* const rays, uint32_t const ray_count)
+{
+	RayPacket packet;
+	for (uint32_t lane = 0; lane < kRayPacketSize; ++lane)
+	{
+		// Spare lanes repeat the first ray, so they hold sane values even though they are never active.
+		Ray const& ray = rays[(lane < ray_count) ? lane : 0];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			packet.origin[axis][lane] = element(ray.origin, axis);
+			packet.direction[axis][lane] = element(ray.direction, axis);
+			packet.inv_direction[axis][lane] = 1.f / element(ray.direction, axis);
+		}
+	}
+	return packet;
+}
+
+void clear_ray_packet_hits(RayPacketHits& hits, float const t_max)
+{
+	for (uint32_t lane = 0; lane < kRayPacketSize; ++lane)
+	{
+		hits.t[lane] = t_max;
+		hits.v[lane] = 0.f;
+		hits.w[lane] = 0.f;
+		hits.triangle_index[lane] = kInvalidTriangle;
+	}
+}
+
+TriangleHit get_ray_packet_hit(RayPacketHits const& hits, uint32_t const lane)
+{
+	TriangleHit hit;
+	hit.triangle_index = hits.triangle_index[lane];
+	hit.t = hits.t[lane];
+	hit.v = hits.v[lane];
+	hit.w = hits.w[lane];
+	return hit;
+}
+
+TriangleRecord get_bvh_leaf_triangle(Bvh const& bvh, uint32_t const node_index, uint32_t const i, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	BvhNode const& node = bvh.nodes[node_index];
+	if (bvh.triangle_blocks)
+	{
+		TriangleBlock const& block = bvh.triangle_blocks[bvh.leaf_block_indices[node_index] + i / kTriangleBlockSize];
+		uint32_t const lane = i % kTriangleBlockSize;
+
+		TriangleRecord triangle;
+		triangle.a = Vec3(block.a[0][lane], block.a[1][lane], block.a[2][lane]);
+		triangle.ab = Vec3(block.ab[0][lane], block.ab[1][lane], block.ab[2][lane]);
+		triangle.ac = Vec3(block.ac[0][lane], block.ac[1][lane], block.ac[2][lane]);
+		triangle.n = Vec3(block.n[0][lane], block.n[1][lane], block.n[2][lane]);
+		return triangle;
+	}
+	if (bvh.triangle_records)
+		return bvh.triangle_records[node.index + i];
+	return make_triangle_record(bvh.primitive_indices[node.index + i], indices, vertices);
+}
+
+struct BvhPacketStackEntry
+{
+	uint32_t node_index;
+	uint32_t active_mask; // rays that entered the parent
+};
+
+// Packets walk the binary nodes, where a box test costs one instruction per axis for all the rays, and every node is
+// fetched once for the whole packet. A ray drops out of a subtree as soon as it misses its box or has a nearer hit.
+void intersect_bvh_packet(Bvh const& bvh, RayPacket const& packet, uint32_t const active_mask, RayPacketHits& hits, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	if (!bvh.node_count || !active_mask)
+		return;
+
+	static bool const use_avx = cpu_supports_avx();
+	BvhNode const* const nodes = bvh.nodes;
+
+	// Children are visited nearest first along the direction of the first ray, which the others roughly share.
+	uint32_t lead_lane = 0;
+	while (!(active_mask & (1u << lead_lane)))
+		++lead_lane;
+	Vec3 const lead_direction(packet.direction[0][lead_lane], packet.direction[1][lead_lane], packet.direction[2][lead_lane]);
+
+	BvhPacketStackEntry stack[kBvhMaxDepth + 1];
+	uint32_t stack_size = 0;
+	stack[stack_size].node_index = 0;
+	stack[stack_size].active_mask = active_mask;
+	stack_size++;
+
+	while (stack_size)
+	{
+		BvhPacketStackEntry const entry = stack[--stack_size];
+		BvhNode const& node = nodes[entry.node_index];
+		COUNT_BVH_NODE_FETCH();
+
+		uint32_t const node_mask = (use_avx)
+			? intersect_ray_packet_aabb_avx(packet, entry.active_mask, node.bounds, hits)
+			: intersect_ray_packet_aabb_sse(packet, entry.active_mask, node.bounds, hits);
+		if (!node_mask)
+			continue;
+
+		if (node.count)
+		{
+			for (uint32_t i = 0; i < node.count; ++i)
+			{
+				uint32_t const triangle_index = bvh.primitive_indices[node.index + i];
+				TriangleRecord const triangle = get_bvh_leaf_triangle(bvh, entry.node_index, i, indices, vertices);
+				if (use_avx)
+					intersect_ray_packet_triangle_avx(packet, node_mask, triangle_index, triangle, hits);
+				else
+					intersect_ray_packet_triangle_sse(packet, node_mask, triangle_index, triangle, hits);
+			}
+		}
+		else
+		{
+			uint32_t near_index = node.index + 0;
+			uint32_t far_index = node.index + 1;
+			if (dot(aabb_centroid(nodes[far_index].bounds) - aabb_centroid(nodes[near_index].bounds), lead_direction) < 0.f)
+				std::swap(near_index, far_index);
+
+			stack[stack_size].node_index = far_index;
+			stack[stack_size].active_mask = node_mask;
+			stack_size++;
+			stack[stack_size].node_index = near_index;
+			stack[stack_size].active_mask = node_mask;
+			stack_size++;
+		}
+	}
+}
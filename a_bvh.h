@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include "a_geom.h"
+#include "a_simd.h"
+
+struct ThreadPool;
+
+struct BvhNode
+{
+	Aabb bounds;
+	uint32_t index; // first child for interior nodes, first primitive for leaves
+	uint32_t count; // zero for interior nodes
+};
+
+struct Bvh
+{
+	uint32_t node_count;
+	uint32_t primitive_count; // more than the scene's triangles when a spatial split BVH duplicates references
+
+	// Nodes, records, blocks and quantized nodes are rewritten in place by refit_triangle_bvh.
+	BvhNode* nodes;
+	uint32_t const* primitive_indices; // leaf order
+	TriangleRecord* triangle_records; // optional, parallel to primitive_indices
+
+	TriangleBlock* triangle_blocks; // optional, replaces the records in leaves
+	uint32_t const* leaf_block_indices; // first block of every leaf, parallel to nodes
+	uint32_t block_count;
+	uint32_t simd_width; // lanes per instruction in the block kernel, 4 or 8
+
+	WideBvhNode const* wide_nodes; // optional, replaces the binary interior nodes in traversal
+	uint32_t wide_node_count;
+	uint32_t wide_width; // most children per wide node
+	uint32_t wide_simd_width; // lanes per instruction in the node kernel, 4 or 8
+
+	QuantizedBvhNode* quantized_nodes; // optional, replaces the wide nodes in traversal
+	uint32_t quantized_node_count;
+};
+
+// Leaves are costed in groups of leaf_granularity primitives, matching the width of the kernel that tests them.
+// The build runs on the pool's threads, or on the calling thread alone without a pool, and produces the same tree, up to
+// node order, for any thread count.
+Bvh build_bvh(uint32_t primitive_count, Aabb const* primitive_bounds, uint32_t leaf_granularity, ThreadPool* pool);
+Bvh build_triangle_bvh(uint32_t triangle_count, uint32_t const* indices, Vec3 const* vertices, uint32_t leaf_granularity, ThreadPool* pool);
+// Spatial split BVH: slower to build, but a triangle may be split between children and referenced from several leaves,
+// up to reference_budget times as many references as triangles in total, so large overlapping triangles cost less to trace.
+Bvh build_triangle_sbvh(uint32_t triangle_count, uint32_t const* indices, Vec3 const* vertices, uint32_t leaf_granularity, float reference_budget);
+void build_bvh_triangle_records(Bvh& bvh, uint32_t const* indices, Vec3 const* vertices);
+void build_bvh_triangle_blocks(Bvh& bvh, uint32_t simd_width, uint32_t const* indices, Vec3 const* vertices);
+void build_bvh_wide_nodes(Bvh& bvh, uint32_t width, uint32_t simd_width);
+void build_bvh_quantized_nodes(Bvh& bvh);
+
+// Recompute every node's bounds bottom-up on the pool's threads after the vertices moved, keeping the tree, and bring
+// the triangle records, blocks and wide node layouts up to date. The tree gets worse as triangles move away from where it
+// was built, so callers should rebuild once bvh_sah_cost has grown too far.
+void refit_triangle_bvh(Bvh& bvh, uint32_t const* indices, Vec3 const* vertices, ThreadPool* pool);
+
+void free_bvh(Bvh& bvh);
+
+float bvh_sah_cost(Bvh const& bvh);
+uint32_t bvh_depth(Bvh const& bvh);
+
+// Nodes visited by this thread's traversals, a packet's shared visit counting once, to judge how coherent the rays are.
+// Only counted while bvh_count_node_fetches is set on the thread; other traversals pay one well-predicted branch a node.
+extern thread_local bool bvh_count_node_fetches;
+extern thread_local uint64_t bvh_node_fetch_count;
+#define COUNT_BVH_NODE_FETCH() (bvh_count_node_fetches ? (void)++bvh_node_fetch_count : (void)0)
+
+float intersect_ray_aabb(Aabb const& box, Vec3 origin, Vec3 inv_direction, float t_max);
+
+TriangleHit intersect_bvh(Bvh const& bvh, Ray ray, float t_max, uint32_t const* indices, Vec3 const* vertices);
+bool occluded_bvh(Bvh const& bvh, Ray ray, float t_max, uint32_t const* indices, Vec3 const* vertices);
+
+RayPacket make_ray_packet(Ray const* rays, uint32_t ray_count);
+void clear_ray_packet_hits(RayPacketHits& hits, float t_max);
+TriangleHit get_ray_packet_hit(RayPacketHits const& hits, uint32_t lane);
+
+// Closest hits for the rays in active_mask, traced together; hits holds each ray's t_max on entry. Coherent rays share
+// most of their node fetches, and incoherent ones are better off with intersect_bvh.
+void intersect_bvh_packet(Bvh const& bvh, RayPacket const& packet, uint32_t active_mask, RayPacketHits& hits, uint32_t const* indices, Vec3 const* vertices);
@@ -2,12 +2,62 @@
 
 #include <float.h>
 
+Ray::Ray()
+	: origin()
+	, direction(0.f, 0.f, -1.f)
+{
+}
+
 Ray::Ray(Vec3 const origin, Vec3 const dir)
 	: origin(origin)
 	, direction(normalize(dir))
 {
 }
 
+Aabb::Aabb()
+	: min(FLT_MAX, FLT_MAX, FLT_MAX)
+	, max(-FLT_MAX, -FLT_MAX, -FLT_MAX)
+{
+}
+
+Aabb::Aabb(Vec3 const min, Vec3 const max)
+	: min(min)
+	, max(max)
+{
+}
+
+Aabb aabb_union(Aabb const lhs, Aabb const rhs)
+{
+	return Aabb(min(lhs.min, rhs.min), max(lhs.max, rhs.max));
+}
+
+Aabb aabb_union(Aabb const lhs, Vec3 const rhs)
+{
+	return Aabb(min(lhs.min, rhs), max(lhs.max, rhs));
+}
+
+Aabb aabb_intersection(Aabb const lhs, Aabb const rhs)
+{
+	return Aabb(max(lhs.min, rhs.min), min(lhs.max, rhs.max));
+}
+
+bool aabb_is_empty(Aabb const box)
+{
+	return box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z;
+}
+
+Vec3 aabb_centroid(Aabb const box)
+{
+	return 0.5f * (box.min + box.max);
+}
+
+float aabb_surface_area(Aabb const box)
+{
+	Vec3 const d = box.max - box.min;
+	if (d.x < 0.f || d.y < 0.f || d.z < 0.f) return 0.f; // empty
+	return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
 Intersection::Intersection()
 	: triangle_index(kInvalidTriangle)
 	, t(FLT_MAX)
@@ -33,7 +83,20 @@ bool Intersection::valid() const
 	return kInvalidTriangle != triangle_index;
 }
 
-Intersection intersect_ray_triangle(Ray const ray, uint32_t const triangle_index, uint32_t const* indices, Vec3 const* vertices)
+TriangleHit::TriangleHit()
+	: triangle_index(kInvalidTriangle)
+	, t(FLT_MAX)
+	, v(0.f)
+	, w(0.f)
+{
+}
+
+bool TriangleHit::valid() const
+{
+	return kInvalidTriangle != triangle_index;
+}
+
+TriangleRecord make_triangle_record(uint32_t const triangle_index, uint32_t const* indices, Vec3 const* vertices)
 {
 	uint32_t const base_index = 3u * triangle_index;
 
@@ -41,37 +104,60 @@ Intersection intersect_ray_triangle(Ray const ray, uint32_t const triangle_index
 	Vec3 const b = vertices[indices[base_index + 1]];
 	Vec3 const c = vertices[indices[base_index + 2]];
 
-	Vec3 const p = ray.origin;
-	Vec3 const q = ray.origin + ray.direction;
+	TriangleRecord triangle;
+	triangle.a = a;
+	triangle.ab = b - a;
+	triangle.ac = c - a;
+	triangle.n = cross(triangle.ab, triangle.ac);
+	return triangle;
+}
 
-	Vec3 const ab = b - a;
-	Vec3 const ac = c - a;
-	Vec3 const qp = p - q;
+TriangleHit intersect_ray_triangle(Ray const ray, float const t_max, uint32_t const triangle_index, TriangleRecord const& triangle)
+{
+	Vec3 const ab = triangle.ab;
+	Vec3 const ac = triangle.ac;
+	Vec3 const qp = -ray.direction;
 
-	Vec3 const n = cross(ab, ac);
+	Vec3 const n = triangle.n;
 
 	float const d = dot(qp, n);
-	if (d <= 0.f) return Intersection();
+	if (d <= 0.f) return TriangleHit();
 
-	Vec3 const ap = p - a;
+	// Every test is done against values scaled by d, so a rejected triangle costs no division.
+	Vec3 const ap = ray.origin - triangle.a;
 	float t = dot(ap, n);
-	if (t < 0.f) return Intersection();
+	if (t < 0.f || t >= t_max * d) return TriangleHit();
 
 	Vec3 const e = cross(qp, ap);
 	float v = dot(ac, e);
-	if (v < 0.f || v > d) return Intersection();
+	if (v < 0.f || v > d) return TriangleHit();
 	float w = -dot(ab, e);
-	if (w < 0.f || v + w > d) return Intersection();
+	if (w < 0.f || v + w > d) return TriangleHit();
 
 	float const ood = 1.f / d;
-	t *= ood;
-	v *= ood;
-	w *= ood;
-	float const u = 1.f - v - w;
+
+	TriangleHit hit;
+	hit.triangle_index = triangle_index;
+	hit.t = t * ood;
+	hit.v = v * ood;
+	hit.w = w * ood;
+	return hit;
+}
+
+TriangleHit intersect_ray_triangle(Ray const ray, float const t_max, uint32_t const triangle_index, uint32_t const* indices, Vec3 const* vertices)
+{
+	return intersect_ray_triangle(ray, t_max, triangle_index, make_triangle_record(triangle_index, indices, vertices));
+}
+
+Intersection finalize_intersection(Ray const ray, TriangleHit const hit, uint32_t const* indices, Vec3 const* vertices)
+{
+	if (!hit.valid()) return Intersection();
+
+	TriangleRecord const triangle = make_triangle_record(hit.triangle_index, indices, vertices);
 
 	Barycentrics bary;
-	bary.u = u;
-	bary.v = v;
-	bary.w = w;
-	return Intersection(ray, t, triangle_index, n, ab, bary);
+	bary.u = 1.f - hit.v - hit.w;
+	bary.v = hit.v;
+	bary.w = hit.w;
+	return Intersection(ray, hit.t, hit.triangle_index, triangle.n, triangle.ab, bary);
 }
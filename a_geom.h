@@ -9,9 +9,27 @@ struct Ray
 	Vec3 direction;
 
 public:
+	Ray();
 	Ray(Vec3 origin, Vec3 dir);
 };
 
+struct Aabb
+{
+	Vec3 min;
+	Vec3 max;
+
+public:
+	Aabb();
+	Aabb(Vec3 min, Vec3 max);
+};
+
+Aabb aabb_union(Aabb lhs, Aabb rhs);
+Aabb aabb_union(Aabb lhs, Vec3 rhs);
+Aabb aabb_intersection(Aabb lhs, Aabb rhs);
+bool aabb_is_empty(Aabb box);
+Vec3 aabb_centroid(Aabb box);
+float aabb_surface_area(Aabb box);
+
 struct Barycentrics
 {
 	float u;
@@ -21,6 +39,28 @@ struct Barycentrics
 
 static const uint32_t kInvalidTriangle = UINT32_MAX;
 
+struct TriangleHit
+{
+	uint32_t triangle_index;
+	float t;
+	float v;
+	float w; // u = 1 - v - w
+
+public:
+	TriangleHit();
+
+	bool valid() const;
+};
+
+// Vertex a with both edges and the unnormalized normal, so a test needs no index lookups or cross product.
+struct TriangleRecord
+{
+	Vec3 a;
+	Vec3 ab;
+	Vec3 ac;
+	Vec3 n;
+};
+
 struct Intersection
 {
 	uint32_t triangle_index;
@@ -37,4 +77,8 @@ public:
 	bool valid() const;
 };
 
-Intersection intersect_ray_triangle(Ray ray, uint32_t triangle_index, uint32_t const* indices, Vec3 const* vertices);
+TriangleRecord make_triangle_record(uint32_t triangle_index, uint32_t const* indices, Vec3 const* vertices);
+
+TriangleHit intersect_ray_triangle(Ray ray, float t_max, uint32_t triangle_index, TriangleRecord const& triangle);
+TriangleHit intersect_ray_triangle(Ray ray, float t_max, uint32_t triangle_index, uint32_t const* indices, Vec3 const* vertices);
+Intersection finalize_intersection(Ray ray, TriangleHit hit, uint32_t const* indices, Vec3 const* vertices);
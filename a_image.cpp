@@ -1,5 +1,6 @@
 #include "a_image.h"
 #include "a_geom.h"
+#include "a_thread_pool.h"
 
 #include <limits.h>
 #include <math.h>
@@ -8,23 +9,30 @@
 #include <string.h>
 
 #include <algorithm>
+#include <vector>
 
 #ifdef _MSC_VER
 #define getc_unlocked _getc_nolock
 #endif
 
+// Rounding can only carry a coordinate one past the end, so a compare does what a modulo would. Truncating to int
+// leaves u's fraction in (-1, 1) without a floorf call, and one more compare lifts a negative one into [0, 1).
 int texel_u(Image const& image, float const u)
 {
 	int const width = image.width;
-	float const x = (u - floorf(u)) * width;
-	return static_cast<int>(x + .5f) % width;
+	float const fraction = u - static_cast<float>(static_cast<int>(u));
+	float const x = ((fraction < 0.f) ? fraction + 1.f : fraction) * width;
+	int const texel = static_cast<int>(x + .5f);
+	return (texel >= width) ? texel - width : texel;
 }
 
+// v comes from an arccosine, so it is never negative and truncation is its floor.
 int texel_v(Image const& image, float const v)
 {
 	int const height = image.height;
-	float const y = (v - floorf(v)) * height;
-	return static_cast<int>(y + .5f) % height;
+	float const y = (v - static_cast<float>(static_cast<int>(v))) * height;
+	int const texel = static_cast<int>(y + .5f);
+	return (texel >= height) ? texel - height : texel;
 }
 
 RGB fetch_bilinear_wrap(Image const& image, float const u, float const v)
@@ -36,10 +44,10 @@ RGB fetch_bilinear_wrap(Image const& image, float const u, float const v)
 	float const x = (u - floorf(u)) * width;
 	float const y = (v - floorf(v)) * height;
 
-	int const x0 = static_cast<int>(x);
-	int const y0 = static_cast<int>(y);
-	int const x1 = (x0+1) % width;
-	int const y1 = (y0+1) % height;
+	int const x0 = std::min(static_cast<int>(x), width - 1);
+	int const y0 = std::min(static_cast<int>(y), height - 1);
+	int const x1 = (x0+1 < width) ? x0+1 : 0;
+	int const y1 = (y0+1 < height) ? y0+1 : 0;
 
 	RGB const m00 = pixels[y0 * width + x0];
 	RGB const m01 = pixels[y0 * width + x1];
@@ -261,52 +269,173 @@ bool write_rgbe(char const* const path, Image const& image)
 	return true;
 }
 
-void precompute_cumulative_probability_density(Image& image)
+float const kSkydomeLightRadius = 6.f;
+float const kSkydomeLightArea = 4.f * 3.14159265358979323846f * kSkydomeLightRadius * kSkydomeLightRadius;
+float const kAngleShift = 3.65f;
+
+// Vose's method: buckets under the average weight are topped up from one over it, which keeps the count of open buckets
+// falling by one per step. Running weights are doubles so rounding doesn't pile up on the buckets filled last; scaled,
+// small and large are scratch space, kept by the caller across tables.
+void build_alias_table(float const* const weights, uint32_t const count, AliasEntry* const table, std::vector<double>& scaled,
+	std::vector<uint32_t>& small, std::vector<uint32_t>& large)
 {
-	int const width = image.width;
-	int const height = image.height;
-	float* const cdf_u = new float[width];
-	float* const cdf_v = new float[width * height];
+	double sum = 0.0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		sum += weights[i];
+	}
+
+	scaled.resize(count);
+	small.clear();
+	large.clear();
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		scaled[i] = (sum > 0.0) ? weights[i] * count / sum : 1.0;
+		if (scaled[i] < 1.0)
+			small.push_back(i);
+		else
+			large.push_back(i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		uint32_t const s = small.back();
+		small.pop_back();
+		uint32_t const l = large.back();
+		large.pop_back();
+
+		table[s].probability = static_cast<float>(scaled[s]);
+		table[s].alias = l;
+
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+		if (scaled[l] < 1.0)
+			small.push_back(l);
+		else
+			large.push_back(l);
+	}
+
+	// Whatever is left is full up to rounding.
+	for (uint32_t const i : large)
+	{
+		table[i].probability = 1.f;
+		table[i].alias = i;
+	}
+	for (uint32_t const i : small)
+	{
+		table[i].probability = 1.f;
+		table[i].alias = i;
+	}
+}
+
+void build_alias_table(float const* const weights, uint32_t const count, AliasEntry* const table)
+{
+	std::vector<double> scaled;
+	std::vector<uint32_t> small;
+	std::vector<uint32_t> large;
+	build_alias_table(weights, count, table, scaled, small, large);
+}
+
+// One lookup and a select: the integer part of u picks the bucket, the fraction decides between it and its alias.
+uint32_t sample_alias_table(AliasEntry const* const table, uint32_t const count, float const u)
+{
+	float const scaled = u * static_cast<float>(count);
+	uint32_t const index = std::min(static_cast<uint32_t>(scaled), count - 1);
+	AliasEntry const entry = table[index];
+	return (scaled - static_cast<float>(index) < entry.probability) ? index : entry.alias;
+}
+
+void precompute_light_sampling_tables(Image& image, ThreadPool& pool)
+{
+	uint32_t const width = static_cast<uint32_t>(image.width);
+	uint32_t const height = static_cast<uint32_t>(image.height);
+	AliasEntry* const alias_u = new AliasEntry[width];
+	AliasEntry* const alias_v = new AliasEntry[width * height];
+	float* const probability_densities = new float[width * height];
+	std::vector<float> column_weights(width);
 
 	float const pi = 3.14159265358979323846f;
 	float const theta_step = pi / static_cast<float>(height);
 
-	float sum_u = 0.f;
-	for (int x = 0; x < width; ++x)
+	// Columns are independent, so every thread takes a run of them.
+	run_thread_pool_chunks(pool, 0, width, [&](uint32_t, uint32_t const chunk_begin, uint32_t const chunk_end)
 	{
-		float sum_v = 0.f;
-		float* const column_v = cdf_v + x * height;
-		for (int y = 0; y < height; ++y)
+		std::vector<float> weights(height);
+		std::vector<double> scaled;
+		std::vector<uint32_t> small;
+		std::vector<uint32_t> large;
+		for (uint32_t x = chunk_begin; x < chunk_end; ++x)
 		{
-			float const lum = luminance(image.pixels[y * width + x]);
-			float const theta = (y + 0.5f) * theta_step;
-			sum_v += lum * sinf(theta);
-			column_v[y] = sum_v;
+			float sum = 0.f;
+			for (uint32_t y = 0; y < height; ++y)
+			{
+				float const theta = (y + 0.5f) * theta_step;
+				weights[y] = luminance(image.pixels[y * width + x]) * sinf(theta);
+				sum += weights[y];
+			}
+			column_weights[x] = sum;
+			build_alias_table(weights.data(), height, alias_v + x * height, scaled, small, large);
 		}
-		sum_u += sum_v;
-		cdf_u[x] = sum_u;
+	});
+
+	std::vector<double> scaled;
+	std::vector<uint32_t> small;
+	std::vector<uint32_t> large;
+	build_alias_table(column_weights.data(), width, alias_u, scaled, small, large);
+
+	// A texel is picked with probability weight / total; its density spreads that over the texel's share of the sphere.
+	double total_weight = 0.0;
+	for (float const column_weight : column_weights)
+	{
+		total_weight += column_weight;
 	}
+	float const normalization_factor = (2.f * pi * pi) / static_cast<float>(width * height);
+	float const density_scale = (total_weight > 0.0) ? static_cast<float>(1.0 / total_weight) / (normalization_factor * kSkydomeLightArea) : 0.f;
 
-	image.cdf_u = cdf_u;
-	image.cdf_v = cdf_v;
-}
+	run_thread_pool_chunks(pool, 0, height, [&](uint32_t, uint32_t const chunk_begin, uint32_t const chunk_end)
+	{
+		for (uint32_t y = chunk_begin; y < chunk_end; ++y)
+		{
+			float const sin_theta = sinf((y + 0.5f) * theta_step);
+			for (uint32_t x = 0; x < width; ++x)
+			{
+				float const weight = luminance(image.pixels[y * width + x]) * sin_theta;
+				probability_densities[y * width + x] = weight * sin_theta * density_scale;
+			}
+		}
+	});
 
-float const kSkydomeLightRadius = 6.f;
-float const kSkydomeLightArea = 4.f * 3.14159265358979323846f * kSkydomeLightRadius * kSkydomeLightRadius;
-float const kAngleShift = 3.65f;
+	image.alias_u = alias_u;
+	image.alias_v = alias_v;
+	image.probability_densities = probability_densities;
+}
 
 Vec3 skydome_light_point(Vec3 const direction)
 {
 	return direction * kSkydomeLightRadius;
 }
 
-SurfaceRadiance skydome_light_radiance(Image const& image, Vec3 const direction)
+void skydome_direction_to_uv(Vec3 const direction, float& u, float& v)
 {
 	float const inv_pi = 0.318309886183790671538f;
 	float const inv_2pi = 0.159154943091895335769f;
 
-	float const u = (atan2f(direction.z, direction.x) - kAngleShift) * inv_2pi;
-	float const v = acosf(direction.y) * inv_pi;
+	u = (fast_atan2f(direction.z, direction.x) - kAngleShift) * inv_2pi;
+	v = fast_acosf(direction.y) * inv_pi;
+}
+
+void skydome_direction_to_uv_exact(Vec3 const direction, float& u, float& v)
+{
+	float const inv_pi = 0.318309886183790671538f;
+	float const inv_2pi = 0.159154943091895335769f;
+
+	u = (atan2f(direction.z, direction.x) - kAngleShift) * inv_2pi;
+	v = acosf(direction.y) * inv_pi;
+}
+
+SurfaceRadiance skydome_light_radiance(Image const& image, Vec3 const direction)
+{
+	float u, v;
+	skydome_direction_to_uv(direction, u, v);
 
 	SurfaceRadiance surface = {};
 	surface.is_light = true;
@@ -318,35 +447,14 @@ SurfaceRadiance skydome_light_radiance(Image const& image, Vec3 const direction)
 
 float skydome_light_probability_density(Image const& image, int const x, int const y)
 {
-	int const width = image.width;
-	int const height = image.height;
-
-	float const pi = 3.14159265358979323846f;
-	float const theta_step = pi / static_cast<float>(height);
-	float const normalization_factor = (2.f * pi * pi) / static_cast<float>(width * height);
-
-	float const* const cdf_u = image.cdf_u;
-	float const* const cdf_v = image.cdf_v + x * height;
-
-	float const probability_density_u = ((x) ? cdf_u[x] - cdf_u[x-1] : cdf_u[0]) / cdf_u[width-1];
-	float const probability_density_v = ((y) ? cdf_v[y] - cdf_v[y-1] : cdf_v[0]) / cdf_v[height-1];
-
-	float const theta = (y + 0.5f) * theta_step;
-	return (probability_density_u * probability_density_v * sinf(theta)) / (normalization_factor * kSkydomeLightArea);
+	return image.probability_densities[y * image.width + x];
 }
 
 float skydome_light_probability_density(Image const& image, Vec3 const direction)
 {
-	float const inv_pi = 0.318309886183790671538f;
-	float const inv_2pi = 0.159154943091895335769f;
-	
-	float const u = (atan2f(direction.z, direction.x) - kAngleShift) * inv_2pi;
-	float const v = acosf(direction.y) * inv_pi;
-
-	int const x = texel_u(image, u);
-	int const y = texel_v(image, v);
-
-	return skydome_light_probability_density(image, x, y);
+	float u, v;
+	skydome_direction_to_uv(direction, u, v);
+	return skydome_light_probability_density(image, texel_u(image, u), texel_v(image, v));
 }
 
 LightSample skydome_light_sample(Image const& image, float const u1, float const u2)
@@ -358,14 +466,9 @@ LightSample skydome_light_sample(Image const& image, float const u1, float const
 	float const phi_step = (2.f * pi) / static_cast<float>(width);
 	float const theta_step = pi / static_cast<float>(height);
 
-	float const* const cdf_u = image.cdf_u;
-	float const* const pos_u = std::lower_bound(cdf_u, cdf_u + width, u1 * cdf_u[width-1]);
-	int const idx_u = static_cast<int>(pos_u - cdf_u);
+	int const idx_u = static_cast<int>(sample_alias_table(image.alias_u, static_cast<uint32_t>(width), u1));
+	int const idx_v = static_cast<int>(sample_alias_table(image.alias_v + idx_u * height, static_cast<uint32_t>(height), u2));
 
-	float const* const cdf_v = image.cdf_v + idx_u * height;
-	float const* const pos_v = std::lower_bound(cdf_v, cdf_v + height, u2 * cdf_v[height-1]);
-	int const idx_v = static_cast<int>(pos_v - cdf_v);
-	
 	float const phi = (idx_u + 0.5f) * phi_step + kAngleShift;
 	float const theta = (idx_v + 0.5f) * theta_step;
 	float const r = sinf(theta);
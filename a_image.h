@@ -3,20 +3,36 @@
 #include <stdint.h>
 #include "a_material.h"
 
+struct ThreadPool;
+
+// One bucket of an alias table [Vose91]: keep the bucket's own index with this probability, else take the alias.
+struct AliasEntry
+{
+	float probability;
+	uint32_t alias;
+};
+
+// Fills count entries of table so that sample_alias_table returns i with probability weights[i] / sum of weights, or
+// uniformly if they sum to zero.
+void build_alias_table(float const* weights, uint32_t count, AliasEntry* table);
+uint32_t sample_alias_table(AliasEntry const* table, uint32_t count, float u);
+
 struct Image
 {
 	int width;
 	int height;
 	RGB* pixels;
 
-	float const* cdf_u;
-	float const* cdf_v;
+	AliasEntry const* alias_u; // one per column, picks a column by its total weight
+	AliasEntry const* alias_v; // a table of one per row for every column, picks a texel in the column
+	float const* probability_densities; // of light samples landing in each texel, as skydome_light_probability_density returns
 };
 
 bool read_rgbe(char const* path, Image& image);
 bool write_rgbe(char const* path, Image const& image);
 
-void precompute_cumulative_probability_density(Image& image);
+// Alias tables for skydome_light_sample and the probability density of every texel, built on the pool's threads.
+void precompute_light_sampling_tables(Image& image, ThreadPool& pool);
 
 struct SurfaceRadiance
 {
@@ -35,6 +51,11 @@ struct LightSample
 	float probability_density;
 };
 
+// Equirect texture coordinates of a direction, unwrapped; the exact version uses atan2f and acosf and is kept to check
+// the polynomial one against, which lands within a hundredth of a texel on skydomes up to 8k wide.
+void skydome_direction_to_uv(Vec3 direction, float& u, float& v);
+void skydome_direction_to_uv_exact(Vec3 direction, float& u, float& v);
+
 SurfaceRadiance skydome_light_radiance(Image const& image, Vec3 direction);
 float skydome_light_probability_density(Image const& image, Vec3 direction);
 LightSample skydome_light_sample(Image const& image, float u1, float u2);
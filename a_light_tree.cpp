@@ -0,0 +1,421 @@
+#include "a_light_tree.h"
+
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+uint32_t const kLightTreeBinCount = 12;
+
+struct LightTreeBin
+{
+	LightBounds light_bounds;
+	uint32_t count;
+};
+
+struct LightTreeBuildTask
+{
+	uint32_t node_index;
+	uint32_t begin;
+	uint32_t end;
+};
+
+LightBounds empty_light_bounds()
+{
+	LightBounds light_bounds;
+	light_bounds.axis = Vec3(0.f, 0.f, 1.f);
+	light_bounds.cos_theta_o = 1.f;
+	light_bounds.cos_theta_e = 1.f;
+	light_bounds.power = 0.f;
+	return light_bounds;
+}
+
+float safe_acosf(float const x)
+{
+	return acosf(std::min(std::max(x, -1.f), 1.f));
+}
+
+// Rodrigues' formula, for an axis perpendicular to v.
+Vec3 rotate_perpendicular(Vec3 const v, Vec3 const axis, float const angle)
+{
+	return cosf(angle) * v + sinf(angle) * cross(axis, v);
+}
+
+// The narrowest cone around both, or a whole sphere (cos_theta = -1) if no cone short of one will do.
+void direction_cone_union(Vec3 const a_axis, float const a_cos_theta, Vec3 const b_axis, float const b_cos_theta, Vec3& axis, float& cos_theta)
+{
+	float const pi = 3.14159265358979323846f;
+	float const theta_a = safe_acosf(a_cos_theta);
+	float const theta_b = safe_acosf(b_cos_theta);
+	float const theta_d = safe_acosf(dot(a_axis, b_axis));
+	if (std::min(theta_d + theta_b, pi) <= theta_a)
+	{
+		axis = a_axis;
+		cos_theta = a_cos_theta;
+		return;
+	}
+	if (std::min(theta_d + theta_a, pi) <= theta_b)
+	{
+		axis = b_axis;
+		cos_theta = b_cos_theta;
+		return;
+	}
+
+	float const theta_o = 0.5f * (theta_a + theta_d + theta_b);
+	Vec3 const rotation_axis = cross(a_axis, b_axis);
+	if (theta_o >= pi || length_sqr(rotation_axis) == 0.f)
+	{
+		axis = a_axis;
+		cos_theta = -1.f;
+		return;
+	}
+
+	axis = rotate_perpendicular(a_axis, normalize(rotation_axis), theta_o - theta_a);
+	cos_theta = cosf(theta_o);
+}
+
+// Emitters without power can't be picked, so they don't widen anything.
+LightBounds light_bounds_union(LightBounds const& lhs, LightBounds const& rhs)
+{
+	if (lhs.power == 0.f)
+		return rhs;
+	if (rhs.power == 0.f)
+		return lhs;
+
+	LightBounds light_bounds;
+	light_bounds.bounds = aabb_union(lhs.bounds, rhs.bounds);
+	direction_cone_union(lhs.axis, lhs.cos_theta_o, rhs.axis, rhs.cos_theta_o, light_bounds.axis, light_bounds.cos_theta_o);
+	light_bounds.cos_theta_e = std::min(lhs.cos_theta_e, rhs.cos_theta_e);
+	light_bounds.power = lhs.power + rhs.power;
+	return light_bounds;
+}
+
+// The surface area orientation heuristic: power times surface area, times the solid angle the cone's light can leave
+// through, weighted by cosine.
+float light_bounds_cost(LightBounds const& light_bounds)
+{
+	if (light_bounds.power == 0.f)
+		return 0.f;
+
+	float const pi = 3.14159265358979323846f;
+	float const theta_o = safe_acosf(light_bounds.cos_theta_o);
+	float const theta_e = safe_acosf(light_bounds.cos_theta_e);
+	float const theta_w = std::min(theta_o + theta_e, pi);
+	float const sin_theta_o = sinf(theta_o);
+	float const m_omega = 2.f * pi * (1.f - light_bounds.cos_theta_o)
+		+ 0.5f * pi * (2.f * theta_w * sin_theta_o - cosf(theta_o - 2.f * theta_w) - 2.f * theta_o * sin_theta_o + light_bounds.cos_theta_o);
+	return light_bounds.power * m_omega * aabb_surface_area(light_bounds.bounds);
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of two angles in [0, pi].
+float cos_sub_clamped(float const sin_a, float const cos_a, float const sin_b, float const cos_b)
+{
+	return (cos_a > cos_b) ? 1.f : cos_a * cos_b + sin_a * sin_b;
+}
+
+float sin_sub_clamped(float const sin_a, float const cos_a, float const sin_b, float const cos_b)
+{
+	return (cos_a > cos_b) ? 0.f : sin_a * cos_b - cos_a * sin_b;
+}
+
+LightTreeNode make_light_tree_node(LightBounds const& light_bounds, uint32_t const index, uint32_t const count)
+{
+	LightTreeNode node;
+	node.center = aabb_centroid(light_bounds.bounds);
+	node.radius = (light_bounds.power > 0.f) ? 0.5f * length(light_bounds.bounds.max - light_bounds.bounds.min) : 0.f;
+	node.axis = light_bounds.axis;
+	node.cos_theta_o = light_bounds.cos_theta_o;
+	node.sin_theta_o = sqrtf(std::max(0.f, 1.f - light_bounds.cos_theta_o * light_bounds.cos_theta_o));
+	node.cos_theta_e = light_bounds.cos_theta_e;
+	node.power = light_bounds.power;
+	node.index = index;
+	node.count = count;
+	return node;
+}
+
+// An upper bound on how much the emitters below a node could light a point on a surface facing normal, up to a
+// constant: power over squared distance, times the most favourable cosines any of them could have, both at the emitter
+// and at the surface.
+float light_tree_node_importance(LightTreeNode const& node, Vec3 const point, Vec3 const normal)
+{
+	if (node.power == 0.f)
+		return 0.f;
+
+	// From inside the bounds, light could come from anywhere.
+	Vec3 const to_point = point - node.center;
+	float const distance_sqr = length_sqr(to_point);
+	float const radius_sqr = node.radius * node.radius;
+	if (distance_sqr <= radius_sqr)
+		return node.power / radius_sqr;
+
+	// Every point in the bounds is within theta_b of the direction to their center, as seen from the point.
+	float const inv_distance = 1.f / sqrtf(distance_sqr);
+	Vec3 const direction = to_point * inv_distance;
+	float const sin_theta_b = node.radius * inv_distance;
+	float const cos_theta_b = sqrtf(std::max(0.f, 1.f - sin_theta_b * sin_theta_b));
+
+	float const cos_theta_w = dot(node.axis, direction);
+	float const sin_theta_w = sqrtf(std::max(0.f, 1.f - cos_theta_w * cos_theta_w));
+	float const cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, node.sin_theta_o, node.cos_theta_o);
+	float const sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, node.sin_theta_o, node.cos_theta_o);
+	float const cos_theta = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+	if (cos_theta <= node.cos_theta_e)
+		return 0.f;
+
+	// Light arriving from below the surface counts for nothing.
+	float const cos_theta_i = -dot(normal, direction);
+	float const sin_theta_i = sqrtf(std::max(0.f, 1.f - cos_theta_i * cos_theta_i));
+	float const cos_theta_i_bound = cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+	if (cos_theta_i_bound <= 0.f)
+		return 0.f;
+
+	return node.power * cos_theta * cos_theta_i_bound / distance_sqr;
+}
+
+LightTree build_light_tree(uint32_t const emitter_count, LightBounds const* const emitters)
+{
+	LightTree tree = {};
+	if (!emitter_count)
+		return tree;
+
+	std::vector<uint32_t> emitter_indices(emitter_count);
+	std::iota(emitter_indices.begin(), emitter_indices.end(), 0u);
+	std::vector<Vec3> centroids(emitter_count);
+	for (uint32_t emitter_index = 0; emitter_index < emitter_count; ++emitter_index)
+	{
+		centroids[emitter_index] = aabb_centroid(emitters[emitter_index].bounds);
+	}
+
+	std::vector<LightTreeNode> nodes(1);
+	std::vector<uint32_t> parent_indices(1, 0u);
+	uint32_t* const leaf_indices = new uint32_t[emitter_count];
+	nodes.reserve(2 * emitter_count - 1);
+	parent_indices.reserve(2 * emitter_count - 1);
+
+	std::vector<LightTreeBuildTask> tasks;
+	tasks.push_back({ 0, 0, emitter_count });
+	while (!tasks.empty())
+	{
+		LightTreeBuildTask const task = tasks.back();
+		tasks.pop_back();
+
+		if (task.end - task.begin == 1)
+		{
+			uint32_t const emitter_index = emitter_indices[task.begin];
+			nodes[task.node_index] = make_light_tree_node(emitters[emitter_index], emitter_index, 1);
+			leaf_indices[emitter_index] = task.node_index;
+			continue;
+		}
+
+		LightBounds light_bounds = empty_light_bounds();
+		Aabb centroid_bounds;
+		for (uint32_t i = task.begin; i < task.end; ++i)
+		{
+			light_bounds = light_bounds_union(light_bounds, emitters[emitter_indices[i]]);
+			centroid_bounds = aabb_union(centroid_bounds, centroids[emitter_indices[i]]);
+		}
+
+		// Binned like the BVH's surface area heuristic, with the cost stretched along the node's shorter axes so
+		// thin slices don't win just by having little area.
+		Vec3 const extent = light_bounds.bounds.max - light_bounds.bounds.min;
+		float const max_extent = std::max(extent.x, std::max(extent.y, extent.z));
+		int best_axis = -1;
+		uint32_t best_bin = 0;
+		float best_cost = FLT_MAX;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float const min = element(centroid_bounds.min, axis);
+			float const centroid_extent = element(centroid_bounds.max, axis) - min;
+			if (!(centroid_extent > 0.f))
+				continue;
+
+			float const scale = static_cast<float>(kLightTreeBinCount) / centroid_extent;
+			LightTreeBin bins[kLightTreeBinCount];
+			for (LightTreeBin& bin : bins)
+			{
+				bin.light_bounds = empty_light_bounds();
+				bin.count = 0;
+			}
+			for (uint32_t i = task.begin; i < task.end; ++i)
+			{
+				uint32_t const emitter_index = emitter_indices[i];
+				uint32_t const bin_index = std::min(static_cast<uint32_t>((element(centroids[emitter_index], axis) - min) * scale), kLightTreeBinCount - 1);
+				bins[bin_index].light_bounds = light_bounds_union(bins[bin_index].light_bounds, emitters[emitter_index]);
+				bins[bin_index].count++;
+			}
+
+			float right_costs[kLightTreeBinCount];
+			uint32_t right_counts[kLightTreeBinCount];
+			LightBounds right = empty_light_bounds();
+			uint32_t right_count = 0;
+			for (uint32_t bin_index = kLightTreeBinCount - 1; bin_index > 0; --bin_index)
+			{
+				right = light_bounds_union(right, bins[bin_index].light_bounds);
+				right_count += bins[bin_index].count;
+				right_costs[bin_index] = light_bounds_cost(right);
+				right_counts[bin_index] = right_count;
+			}
+
+			float const regularization = max_extent / element(extent, axis);
+			LightBounds left = empty_light_bounds();
+			uint32_t left_count = 0;
+			for (uint32_t bin_index = 0; bin_index < kLightTreeBinCount - 1; ++bin_index)
+			{
+				left = light_bounds_union(left, bins[bin_index].light_bounds);
+				left_count += bins[bin_index].count;
+				if (!left_count || !right_counts[bin_index + 1])
+					continue;
+
+				float const cost = regularization * (light_bounds_cost(left) + right_costs[bin_index + 1]);
+				if (cost < best_cost)
+				{
+					best_axis = axis;
+					best_bin = bin_index;
+					best_cost = cost;
+				}
+			}
+		}
+
+		uint32_t* const begin = emitter_indices.data() + task.begin;
+		uint32_t* const end = emitter_indices.data() + task.end;
+		uint32_t* middle = begin + (task.end - task.begin) / 2;
+		if (best_axis >= 0)
+		{
+			float const min = element(centroid_bounds.min, best_axis);
+			float const scale = static_cast<float>(kLightTreeBinCount) / (element(centroid_bounds.max, best_axis) - min);
+			middle = std::partition(begin, end, [&](uint32_t const emitter_index)
+			{
+				return std::min(static_cast<uint32_t>((element(centroids[emitter_index], best_axis) - min) * scale), kLightTreeBinCount - 1) <= best_bin;
+			});
+		}
+		// Emitters all in one place are split in two by count.
+		if (middle == begin || middle == end)
+		{
+			middle = begin + (task.end - task.begin) / 2;
+		}
+
+		uint32_t const first_child = static_cast<uint32_t>(nodes.size());
+		nodes.resize(first_child + 2);
+		parent_indices.push_back(task.node_index);
+		parent_indices.push_back(task.node_index);
+
+		nodes[task.node_index] = make_light_tree_node(light_bounds, first_child, 0);
+
+		uint32_t const split = task.begin + static_cast<uint32_t>(middle - begin);
+		tasks.push_back({ first_child + 1, split, task.end });
+		tasks.push_back({ first_child + 0, task.begin, split });
+	}
+
+	LightTreeNode* const tree_nodes = new LightTreeNode[nodes.size()];
+	std::copy(nodes.begin(), nodes.end(), tree_nodes);
+	uint32_t* const tree_parent_indices = new uint32_t[parent_indices.size()];
+	std::copy(parent_indices.begin(), parent_indices.end(), tree_parent_indices);
+
+	tree.node_count = static_cast<uint32_t>(nodes.size());
+	tree.nodes = tree_nodes;
+	tree.parent_indices = tree_parent_indices;
+	tree.leaf_indices = leaf_indices;
+	return tree;
+}
+
+void refit_light_tree(LightTree& tree, LightBounds const* const emitters)
+{
+	// Children always come after their parent, so walking the nodes backwards visits both children first.
+	std::vector<LightBounds> node_bounds(tree.node_count);
+	for (uint32_t node_index = tree.node_count; node_index-- > 0;)
+	{
+		LightTreeNode& node = tree.nodes[node_index];
+		if (node.count)
+		{
+			node_bounds[node_index] = emitters[node.index];
+		}
+		else
+		{
+			node_bounds[node_index] = light_bounds_union(node_bounds[node.index + 0], node_bounds[node.index + 1]);
+		}
+		node = make_light_tree_node(node_bounds[node_index], node.index, node.count);
+	}
+}
+
+void free_light_tree(LightTree& tree)
+{
+	delete[] tree.nodes;
+	delete[] tree.parent_indices;
+	delete[] tree.leaf_indices;
+	tree = LightTree();
+}
+
+uint32_t sample_light_tree(LightTree const& tree, Vec3 const point, Vec3 const normal, float u, float& probability)
+{
+	probability = 0.f;
+	if (!tree.node_count)
+		return kInvalidLight;
+
+	LightTreeNode const* const nodes = tree.nodes;
+	if (nodes[0].count)
+	{
+		if (light_tree_node_importance(nodes[0], point, normal) <= 0.f)
+			return kInvalidLight;
+		probability = 1.f;
+		return nodes[0].index;
+	}
+
+	// Each step rescales u to [0, 1) within the child it picked, for the next one.
+	float path_probability = 1.f;
+	uint32_t node_index = 0;
+	while (!nodes[node_index].count)
+	{
+		uint32_t const first_child = nodes[node_index].index;
+		float const left = light_tree_node_importance(nodes[first_child + 0], point, normal);
+		float const right = light_tree_node_importance(nodes[first_child + 1], point, normal);
+		float const total = left + right;
+		if (!(total > 0.f))
+			return kInvalidLight;
+
+		float const left_probability = left / total;
+		if (u < left_probability)
+		{
+			u = std::min(u / left_probability, 0.99999994f);
+			path_probability *= left_probability;
+			node_index = first_child + 0;
+		}
+		else
+		{
+			u = std::min((u - left_probability) / (1.f - left_probability), 0.99999994f);
+			path_probability *= right / total;
+			node_index = first_child + 1;
+		}
+	}
+
+	probability = path_probability;
+	return nodes[node_index].index;
+}
+
+float light_tree_probability(LightTree const& tree, uint32_t const emitter_index, Vec3 const point, Vec3 const normal)
+{
+	if (!tree.node_count)
+		return 0.f;
+
+	LightTreeNode const* const nodes = tree.nodes;
+	if (nodes[0].count)
+		return (light_tree_node_importance(nodes[0], point, normal) > 0.f) ? 1.f : 0.f;
+
+	float probability = 1.f;
+	uint32_t node_index = tree.leaf_indices[emitter_index];
+	while (node_index != 0)
+	{
+		uint32_t const parent_index = tree.parent_indices[node_index];
+		uint32_t const first_child = nodes[parent_index].index;
+		float const left = light_tree_node_importance(nodes[first_child + 0], point, normal);
+		float const right = light_tree_node_importance(nodes[first_child + 1], point, normal);
+		float const own = (node_index == first_child) ? left : right;
+		if (!(own > 0.f))
+			return 0.f;
+
+		probability *= own / (left + right);
+		node_index = parent_index;
+	}
+	return probability;
+}
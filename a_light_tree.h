@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include "a_geom.h"
+#include "a_math.h"
+
+static const uint32_t kInvalidLight = UINT32_MAX;
+
+// Where emitters are and where they shine: every one lies in bounds and emits within theta_e of some direction that is
+// itself within theta_o of axis. A one-sided triangle has theta_o = 0 around its normal and theta_e = pi / 2.
+struct LightBounds
+{
+	Aabb bounds;
+	Vec3 axis;
+	float cos_theta_o;
+	float cos_theta_e;
+	float power;
+};
+
+// The light bounds of every emitter below, with the box kept as the sphere around it and the sines worked out ahead.
+struct LightTreeNode
+{
+	Vec3 center;
+	float radius;
+	Vec3 axis;
+	float cos_theta_o;
+	float sin_theta_o;
+	float cos_theta_e;
+	float power;
+	uint32_t index; // first child for interior nodes, the emitter for leaves
+	uint32_t count; // zero for interior nodes
+};
+
+// A binary tree over emitters with one emitter per leaf [Conty Estevez and Kulla 2018]. Sampling walks down from the
+// root, picking between two children in proportion to how much they might light the shading point; the probability of
+// an emitter walks back up from its leaf, so both take O(log emitter_count) steps.
+struct LightTree
+{
+	uint32_t node_count;
+	LightTreeNode* nodes; // rewritten in place by refit_light_tree
+	uint32_t const* parent_indices; // per node, the root's unused
+	uint32_t const* leaf_indices; // per emitter
+};
+
+LightTree build_light_tree(uint32_t emitter_count, LightBounds const* emitters);
+// Recomputes every node's bounds, cones and power from the same emitters moved, keeping the tree's topology.
+void refit_light_tree(LightTree& tree, LightBounds const* emitters);
+void free_light_tree(LightTree& tree);
+
+// An emitter for a point on a surface facing normal, with the probability it was picked with, or kInvalidLight if
+// nothing in the tree can light the point.
+uint32_t sample_light_tree(LightTree const& tree, Vec3 point, Vec3 normal, float u, float& probability);
+float light_tree_probability(LightTree const& tree, uint32_t emitter_index, Vec3 point, Vec3 normal);
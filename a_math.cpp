@@ -41,6 +41,22 @@ Vec3 operator-(Vec3 const v)
 	return Vec3(-v.x, -v.y, -v.z);
 }
 
+// Plain comparisons rather than fminf/fmaxf, which are library calls when NaNs have to be handled.
+Vec3 min(Vec3 const lhs, Vec3 const rhs)
+{
+	return Vec3((lhs.x < rhs.x) ? lhs.x : rhs.x, (lhs.y < rhs.y) ? lhs.y : rhs.y, (lhs.z < rhs.z) ? lhs.z : rhs.z);
+}
+
+Vec3 max(Vec3 const lhs, Vec3 const rhs)
+{
+	return Vec3((lhs.x > rhs.x) ? lhs.x : rhs.x, (lhs.y > rhs.y) ? lhs.y : rhs.y, (lhs.z > rhs.z) ? lhs.z : rhs.z);
+}
+
+float element(Vec3 const v, int const axis)
+{
+	return (&v.x)[axis];
+}
+
 float dot(Vec3 const lhs, Vec3 const rhs)
 {
 	return lhs.x * rhs.x + lhs.y * rhs.y + lhs.z * rhs.z;
@@ -80,6 +96,35 @@ Vec3 reflect(Vec3 const v, Vec3 const normal)
 	return -v + 2.f * dot(v, normal) * normal;
 }
 
+float fast_atan2f(float const y, float const x)
+{
+	float const pi = 3.14159265358979323846f;
+	float const half_pi = 1.57079632679489661923f;
+
+	// atan of the smaller over the larger magnitude, in [0, 1], then folded out to the right octant.
+	float const ax = fabsf(x);
+	float const ay = fabsf(y);
+	float const larger = (ax > ay) ? ax : ay;
+	float const a = ((ax < ay) ? ax : ay) / ((larger > 1e-30f) ? larger : 1e-30f);
+	float const s = a * a;
+	float r = (((((-0.01172120f * s + 0.05265332f) * s - 0.11643287f) * s + 0.19354346f) * s - 0.33262347f) * s + 0.99997726f) * a;
+	r = (ay > ax) ? half_pi - r : r;
+	r = (x < 0.f) ? pi - r : r;
+	return (y < 0.f) ? -r : r;
+}
+
+// [Abramowitz and Stegun 4.4.46] for the magnitude, mirrored for negative x.
+float fast_acosf(float const x)
+{
+	float const pi = 3.14159265358979323846f;
+
+	float const ax = (fabsf(x) < 1.f) ? fabsf(x) : 1.f;
+	float const p = ((((((-0.0012624911f * ax + 0.0066700901f) * ax - 0.0170881256f) * ax + 0.0308918810f) * ax - 0.0501743046f) * ax
+		+ 0.0889789874f) * ax - 0.2145988016f) * ax + 1.5707963050f;
+	float const r = sqrtf(1.f - ax) * p;
+	return (x < 0.f) ? pi - r : r;
+}
+
 Mat33::Mat33()
 	: col{
 		Vec3(1.f, 0.f, 0.f),
@@ -107,3 +152,55 @@ Vec3 inv_ortho_transform_vector(Mat33 const& lhs, Vec3 const rhs)
 {
 	return Vec3(dot(lhs.col[0], rhs), dot(lhs.col[1], rhs), dot(lhs.col[2], rhs));
 }
+
+Mat33 operator*(Mat33 const& lhs, Mat33 const& rhs)
+{
+	return Mat33(transform_vector(lhs, rhs.col[0]), transform_vector(lhs, rhs.col[1]), transform_vector(lhs, rhs.col[2]));
+}
+
+Mat33 inverse(Mat33 const& m)
+{
+	// The rows of the inverse are the cross products of pairs of columns, over the determinant.
+	Vec3 const row0 = cross(m.col[1], m.col[2]);
+	Vec3 const row1 = cross(m.col[2], m.col[0]);
+	Vec3 const row2 = cross(m.col[0], m.col[1]);
+	float const inv_det = 1.f / dot(m.col[0], row0);
+	return Mat33(
+		Vec3(row0.x, row1.x, row2.x) * inv_det,
+		Vec3(row0.y, row1.y, row2.y) * inv_det,
+		Vec3(row0.z, row1.z, row2.z) * inv_det
+	);
+}
+
+Mat34::Mat34()
+	: linear()
+	, translation()
+{
+}
+
+Mat34::Mat34(Mat33 const& linear, Vec3 const translation)
+	: linear(linear)
+	, translation(translation)
+{
+}
+
+Mat34 operator*(Mat34 const& lhs, Mat34 const& rhs)
+{
+	return Mat34(lhs.linear * rhs.linear, transform_point(lhs, rhs.translation));
+}
+
+Mat34 inverse(Mat34 const& m)
+{
+	Mat33 const inv_linear = inverse(m.linear);
+	return Mat34(inv_linear, -transform_vector(inv_linear, m.translation));
+}
+
+Vec3 transform_point(Mat34 const& lhs, Vec3 const rhs)
+{
+	return transform_vector(lhs.linear, rhs) + lhs.translation;
+}
+
+Vec3 transform_vector(Mat34 const& lhs, Vec3 const rhs)
+{
+	return transform_vector(lhs.linear, rhs);
+}
@@ -18,6 +18,10 @@ Vec3 operator*(Vec3 v, float s);
 
 Vec3 operator-(Vec3 v);
 
+Vec3 min(Vec3 lhs, Vec3 rhs);
+Vec3 max(Vec3 lhs, Vec3 rhs);
+float element(Vec3 v, int axis);
+
 float dot(Vec3 lhs, Vec3 rhs);
 Vec3 cross(Vec3 lhs, Vec3 rhs);
 
@@ -28,6 +32,10 @@ Vec3 normalize(Vec3 v);
 
 Vec3 reflect(Vec3 v, Vec3 normal);
 
+// Branch-free polynomial approximations for hot lookups: fast_atan2f is within 1e-5 radians, fast_acosf within 1e-6.
+float fast_atan2f(float y, float x);
+float fast_acosf(float x);
+
 struct Mat33
 {
 	Vec3 col[3];
@@ -39,3 +47,23 @@ public:
 
 Vec3 transform_vector(Mat33 const& lhs, Vec3 rhs);
 Vec3 inv_ortho_transform_vector(Mat33 const& lhs, Vec3 rhs);
+
+Mat33 operator*(Mat33 const& lhs, Mat33 const& rhs);
+Mat33 inverse(Mat33 const& m);
+
+// Affine transform: the linear part, then the translation.
+struct Mat34
+{
+	Mat33 linear;
+	Vec3 translation;
+
+public:
+	Mat34();
+	Mat34(Mat33 const& linear, Vec3 translation);
+};
+
+Mat34 operator*(Mat34 const& lhs, Mat34 const& rhs);
+Mat34 inverse(Mat34 const& m);
+
+Vec3 transform_point(Mat34 const& lhs, Vec3 rhs);
+Vec3 transform_vector(Mat34 const& lhs, Vec3 rhs);
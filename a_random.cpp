@@ -0,0 +1,54 @@
+#include "a_random.h"
+
+RandomStream make_random_stream(uint32_t const pixel_index, uint32_t const sample_index)
+{
+	uint64_t const start = (static_cast<uint64_t>(random_bits(pixel_index, sample_index, 1)) << 32) | random_bits(pixel_index, sample_index, 0);
+
+	// Seeded the way the PCG reference seeds, so the start is mixed in before the first number.
+	RandomStream stream;
+	stream.state = 0;
+	stream.increment = (((static_cast<uint64_t>(pixel_index) << 32) | sample_index) << 1) | 1u;
+	random_uint32(stream);
+	stream.state += start;
+	random_uint32(stream);
+	return stream;
+}
+
+uint32_t random_bits(uint32_t const pixel_index, uint32_t const sample_index, uint32_t const dimension)
+{
+	uint32_t const multiplier = 0xd256d193u;
+	uint32_t const key_increment = 0x9e3779b9u; // golden ratio
+
+	uint32_t counter0 = sample_index;
+	uint32_t counter1 = dimension;
+	uint32_t key = pixel_index;
+	for (int round = 0; round < 10; ++round)
+	{
+		uint64_t const product = static_cast<uint64_t>(multiplier) * counter0;
+		counter0 = static_cast<uint32_t>(product >> 32) ^ key ^ counter1;
+		counter1 = static_cast<uint32_t>(product);
+		key += key_increment;
+	}
+	return counter0;
+}
+
+// PCG-XSH-RR: step the 64-bit LCG, then output a xorshifted, randomly rotated 32 bits of the old state.
+uint32_t random_uint32(RandomStream& stream)
+{
+	uint64_t const state = stream.state;
+	stream.state = state * 6364136223846793005ull + stream.increment;
+
+	uint32_t const xorshifted = static_cast<uint32_t>(((state >> 18) ^ state) >> 27);
+	uint32_t const rotation = static_cast<uint32_t>(state >> 59);
+	return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+}
+
+float random_float(RandomStream& stream)
+{
+	return static_cast<float>(random_uint32(stream) >> 8) * (1.f / 16777216.f); // 24 bits fill a float's mantissa exactly
+}
+
+uint32_t random_index(RandomStream& stream, uint32_t const count)
+{
+	return static_cast<uint32_t>((static_cast<uint64_t>(random_uint32(stream)) * count) >> 32);
+}
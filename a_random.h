@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// A PCG32 generator per path sample: 16 bytes of state that stay in registers, a multiply-add and a rotate per number.
+// Each sample's stream is picked by its pixel and sample index, and its start is scrambled from them with Philox, so a
+// sample draws the same numbers whichever thread takes it and in whatever order, and no two samples share a stream.
+struct RandomStream
+{
+	uint64_t state;
+	uint64_t increment; // odd, and different for every pixel and sample
+};
+
+RandomStream make_random_stream(uint32_t pixel_index, uint32_t sample_index);
+
+// Philox-2x32-10 of the counter (sample_index, dimension) under the key pixel_index.
+uint32_t random_bits(uint32_t pixel_index, uint32_t sample_index, uint32_t dimension);
+
+uint32_t random_uint32(RandomStream& stream);
+float random_float(RandomStream& stream); // [0, 1)
+uint32_t random_index(RandomStream& stream, uint32_t count); // [0, count)
@@ -0,0 +1,272 @@
+#include "a_sampler.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+PathSampler make_path_sampler(SamplerSetup const& setup, uint32_t const pixel_index, uint32_t const sample_index)
+{
+	PathSampler sampler;
+	sampler.setup = &setup;
+	sampler.pixel_index = pixel_index;
+	sampler.sample_index = sample_index;
+	sampler.pair_index = 0;
+
+	// Only the random sampler draws from the stream, and seeding it costs two Philox evaluations.
+	sampler.random = RandomStream();
+	if (setup.type == kSamplerRandom)
+		sampler.random = make_random_stream(pixel_index, setup.frame_index * setup.sample_count + sample_index);
+	return sampler;
+}
+
+// A cheap, well-mixed integer hash (the "lowbias32" finalizer), enough to derive scrambling seeds.
+uint32_t hash_bits(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+uint32_t reverse_bits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Laine-Karras style hash in which every bit only depends on the bits below it, as improved by [Burley20].
+uint32_t laine_karras_permutation(uint32_t x, uint32_t const seed)
+{
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1u;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return x;
+}
+
+// Owen scrambling in base 2: each bit is flipped or not depending on the bits above it.
+uint32_t owen_scramble(uint32_t const x, uint32_t const seed)
+{
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Element i of a random permutation of [0, count) picked by seed [Kensler13].
+uint32_t permute_index(uint32_t i, uint32_t const count, uint32_t const seed)
+{
+	uint32_t mask = count - 1;
+	mask |= mask >> 1;
+	mask |= mask >> 2;
+	mask |= mask >> 4;
+	mask |= mask >> 8;
+	mask |= mask >> 16;
+
+	do // Cycle walk until the hash lands inside [0, count).
+	{
+		i ^= seed;
+		i *= 0xe170893du;
+		i ^= seed >> 16;
+		i ^= (i & mask) >> 4;
+		i ^= seed >> 8;
+		i *= 0x0929eb3fu;
+		i ^= seed >> 23;
+		i ^= (i & mask) >> 1;
+		i *= 1u | seed >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & mask) >> 11;
+		i *= 0x74dcb303u;
+		i ^= (i & mask) >> 2;
+		i *= 0x9e501cc3u;
+		i ^= (i & mask) >> 2;
+		i *= 0xc860a3dfu;
+		i &= mask;
+		i ^= i >> 5;
+	} while (i >= count);
+	return (i + seed) % count;
+}
+
+// The first two Sobol dimensions as 32-bit fractions: the van der Corput sequence, and its partner, whose direction
+// numbers each XOR the previous one with itself shifted down a bit.
+void sobol_2d(uint32_t index, uint32_t& x, uint32_t& y)
+{
+	x = reverse_bits(index);
+	y = 0;
+	for (uint32_t direction = 0x80000000u; index; index >>= 1, direction ^= direction >> 1)
+	{
+		if (index & 1)
+			y ^= direction;
+	}
+}
+
+float bits_to_float(uint32_t const bits)
+{
+	return static_cast<float>(bits >> 8) * (1.f / 16777216.f);
+}
+
+float fraction(float const x)
+{
+	return x - floorf(x);
+}
+
+void sample_2d(PathSampler& sampler, float& u1, float& u2)
+{
+	SamplerSetup const& setup = *sampler.setup;
+	uint32_t const pair_index = sampler.pair_index++;
+
+	if (setup.type == kSamplerSobol)
+	{
+		// Every pair shuffles the pixel's samples its own way, so the pairs don't correlate with each other, and then
+		// scrambles the points, so the pixels don't correlate either.
+		uint32_t const seed = hash_bits(sampler.pixel_index ^ hash_bits(pair_index + 0x9e3779b9u) ^ hash_bits(setup.frame_index));
+		uint32_t const index = permute_index(sampler.sample_index, setup.sample_count, seed);
+		uint32_t x, y;
+		sobol_2d(index, x, y);
+		u1 = bits_to_float(owen_scramble(x, hash_bits(seed ^ 0x68e31da4u)));
+		u2 = bits_to_float(owen_scramble(y, hash_bits(seed ^ 0xb5297a4du)));
+		return;
+	}
+
+	if (setup.type == kSamplerBlueNoise)
+	{
+		// Each dimension reads the tile at its own offset, so the dimensions don't correlate, and every sample of every
+		// frame rotates the values by the next point of a rank-1 lattice (the R2 sequence), which stays well spread over
+		// samples and frames while keeping the tile's blue noise across pixels.
+		uint32_t const mask = kBlueNoiseTileSize - 1;
+		uint32_t const x = sampler.pixel_index % setup.image_width;
+		uint32_t const y = sampler.pixel_index / setup.image_width;
+		uint32_t const offset1 = hash_bits(2 * pair_index + 0x1b873593u);
+		uint32_t const offset2 = hash_bits(2 * pair_index + 0x1b873594u);
+		float const value1 = setup.blue_noise[((y + (offset1 >> 16)) & mask) * kBlueNoiseTileSize + ((x + offset1) & mask)];
+		float const value2 = setup.blue_noise[((y + (offset2 >> 16)) & mask) * kBlueNoiseTileSize + ((x + offset2) & mask)];
+
+		float const rotation_index = static_cast<float>(setup.frame_index * setup.sample_count + sampler.sample_index);
+		u1 = std::min(fraction(value1 + rotation_index * 0.7548776662f), 0.99999994f);
+		u2 = std::min(fraction(value2 + rotation_index * 0.5698402910f), 0.99999994f);
+		return;
+	}
+
+	u1 = random_float(sampler.random);
+	u2 = random_float(sampler.random);
+}
+
+float* build_blue_noise_tile(uint32_t const seed)
+{
+	uint32_t const size = kBlueNoiseTileSize;
+	uint32_t const mask = size - 1;
+	uint32_t const pixel_count = size * size;
+	float const sigma = 1.5f;
+
+	// Energy a set pixel adds to every other pixel: a Gaussian of their distance, wrapped around so the tile repeats.
+	std::vector<float> kernel(pixel_count);
+	for (uint32_t dy = 0; dy < size; ++dy)
+	{
+		for (uint32_t dx = 0; dx < size; ++dx)
+		{
+			float const wx = static_cast<float>(std::min(dx, size - dx));
+			float const wy = static_cast<float>(std::min(dy, size - dy));
+			kernel[dy * size + dx] = expf(-(wx * wx + wy * wy) / (2.f * sigma * sigma));
+		}
+	}
+
+	std::vector<uint8_t> set(pixel_count, 0);
+	std::vector<float> energy(pixel_count, 0.f);
+	auto const toggle = [&](uint32_t const pixel, bool const value)
+	{
+		set[pixel] = value;
+		float const sign = value ? 1.f : -1.f;
+		uint32_t const px = pixel % size;
+		uint32_t const py = pixel / size;
+		for (uint32_t y = 0; y < size; ++y)
+		{
+			float const* const kernel_row = &kernel[((y - py) & mask) * size];
+			for (uint32_t x = 0; x < size; ++x)
+			{
+				energy[y * size + x] += sign * kernel_row[(x - px) & mask];
+			}
+		}
+	};
+	auto const tightest_cluster = [&]()
+	{
+		uint32_t best = 0;
+		float best_energy = -1.f;
+		for (uint32_t pixel = 0; pixel < pixel_count; ++pixel)
+		{
+			if (set[pixel] && energy[pixel] > best_energy)
+			{
+				best = pixel;
+				best_energy = energy[pixel];
+			}
+		}
+		return best;
+	};
+	auto const largest_void = [&]()
+	{
+		uint32_t best = 0;
+		float best_energy = 3.4e38f;
+		for (uint32_t pixel = 0; pixel < pixel_count; ++pixel)
+		{
+			if (!set[pixel] && energy[pixel] < best_energy)
+			{
+				best = pixel;
+				best_energy = energy[pixel];
+			}
+		}
+		return best;
+	};
+
+	// Start from a random tenth of the pixels, then move the most crowded one to the emptiest spot until that stops
+	// helping, which leaves an evenly spread prototype pattern.
+	uint32_t const prototype_count = pixel_count / 10;
+	RandomStream random = make_random_stream(seed, 0);
+	for (uint32_t count = 0; count < prototype_count; )
+	{
+		uint32_t const pixel = random_index(random, pixel_count);
+		if (!set[pixel])
+		{
+			toggle(pixel, true);
+			++count;
+		}
+	}
+	for (uint32_t iteration = 0; iteration < pixel_count; ++iteration)
+	{
+		uint32_t const cluster = tightest_cluster();
+		toggle(cluster, false);
+		uint32_t const empty = largest_void();
+		toggle(empty, true);
+		if (empty == cluster)
+			break;
+	}
+
+	// Rank the prototype's pixels by taking the most crowded first, then fill the rest emptiest first. Filling all the
+	// way rather than switching to the minority pixels past half is a common simplification that looks the same.
+	std::vector<uint32_t> ranks(pixel_count);
+	std::vector<uint8_t> const prototype_set = set;
+	std::vector<float> const prototype_energy = energy;
+	for (uint32_t rank = prototype_count; rank > 0; --rank)
+	{
+		uint32_t const cluster = tightest_cluster();
+		toggle(cluster, false);
+		ranks[cluster] = rank - 1;
+	}
+	set = prototype_set;
+	energy = prototype_energy;
+	for (uint32_t rank = prototype_count; rank < pixel_count; ++rank)
+	{
+		uint32_t const empty = largest_void();
+		toggle(empty, true);
+		ranks[empty] = rank;
+	}
+
+	float* const values = new float[pixel_count];
+	for (uint32_t pixel = 0; pixel < pixel_count; ++pixel)
+	{
+		values[pixel] = (static_cast<float>(ranks[pixel]) + 0.5f) / static_cast<float>(pixel_count);
+	}
+	return values;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include "a_random.h"
+
+uint32_t const kSamplerRandom = 0; // independent PCG32 numbers
+uint32_t const kSamplerSobol = 1; // padded Owen-scrambled Sobol
+uint32_t const kSamplerBlueNoise = 2; // blue-noise dithered across pixels, for previews at a few samples per pixel
+
+uint32_t const kBlueNoiseTileSize = 64;
+
+// What the samplers of one frame share.
+struct SamplerSetup
+{
+	uint32_t type;
+	uint32_t sample_count; // per pixel
+	uint32_t frame_index; // frames draw different numbers
+	uint32_t image_width; // to find a pixel in the blue-noise tile
+	float const* blue_noise; // kBlueNoiseTileSize squared values in [0, 1), for kSamplerBlueNoise
+};
+
+// Numbers for one path sample, drawn in 2D pairs. A path uses its pairs in a fixed order, so whichever sampler is plugged
+// in, each decision along the path always gets the same dimensions and the samples of a pixel are stratified in them.
+struct PathSampler
+{
+	SamplerSetup const* setup;
+	uint32_t pixel_index;
+	uint32_t sample_index;
+	uint32_t pair_index; // the next one to draw
+	RandomStream random;
+};
+
+PathSampler make_path_sampler(SamplerSetup const& setup, uint32_t pixel_index, uint32_t sample_index);
+
+// Two numbers in [0, 1) for the next pair of dimensions.
+void sample_2d(PathSampler& sampler, float& u1, float& u2);
+
+// A tile of values in void-and-cluster order [Ulichney93]: thresholding it at any level leaves evenly spread pixels with
+// no low-frequency clumps, so neighbouring pixels get values far apart and their error looks like fine grain.
+float* build_blue_noise_tile(uint32_t seed);
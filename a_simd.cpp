@@ -0,0 +1,524 @@
+#include "a_simd.h"
+
+#include <float.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define A_TARGET_AVX
+#else
+#define A_TARGET_AVX __attribute__((target("avx")))
+#endif
+
+float decode_quantized_bound(float const origin, float const scale, uint32_t const q)
+{
+	return _mm_cvtss_f32(_mm_add_ss(_mm_set_ss(origin), _mm_mul_ss(_mm_set_ss(static_cast<float>(q)), _mm_set_ss(scale))));
+}
+
+void* allocate_cache_aligned(size_t const size)
+{
+	return _mm_malloc(size, 64);
+}
+
+void free_cache_aligned(void* const memory)
+{
+	_mm_free(memory);
+}
+
+bool cpu_supports_avx()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	bool const has_osxsave = 0 != (info[2] & (1 << 27));
+	bool const has_avx = 0 != (info[2] & (1 << 28));
+	if (!has_osxsave || !has_avx)
+		return false;
+	return 6 == (_xgetbv(0) & 6); // the OS saves the ymm registers
+#else
+	return __builtin_cpu_supports("avx");
+#endif
+}
+
+uint32_t detect_simd_width()
+{
+	return (cpu_supports_avx()) ? 8 : 4;
+}
+
+void clear_triangle_block(TriangleBlock& block)
+{
+	for (uint32_t lane = 0; lane < kTriangleBlockSize; ++lane)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			block.a[axis][lane] = 0.f;
+			block.ab[axis][lane] = 0.f;
+			block.ac[axis][lane] = 0.f;
+			block.n[axis][lane] = 0.f;
+		}
+		block.triangle_index[lane] = kInvalidTriangle;
+	}
+	block.count = 0;
+}
+
+void set_triangle_block_lane(TriangleBlock& block, uint32_t const lane, uint32_t const triangle_index, TriangleRecord const& triangle)
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		block.a[axis][lane] = element(triangle.a, axis);
+		block.ab[axis][lane] = element(triangle.ab, axis);
+		block.ac[axis][lane] = element(triangle.ac, axis);
+		block.n[axis][lane] = element(triangle.n, axis);
+	}
+	block.triangle_index[lane] = triangle_index;
+}
+
+// Both node kernels are the scalar intersect_ray_aabb run across children.
+
+uint32_t intersect_ray_wide_node_sse(WideBvhNode const& node, Vec3 const origin, Vec3 const inv_direction, float const t_max, float* const t_entries)
+{
+	__m128 const origin_x = _mm_set1_ps(origin.x);
+	__m128 const origin_y = _mm_set1_ps(origin.y);
+	__m128 const origin_z = _mm_set1_ps(origin.z);
+	__m128 const inv_direction_x = _mm_set1_ps(inv_direction.x);
+	__m128 const inv_direction_y = _mm_set1_ps(inv_direction.y);
+	__m128 const inv_direction_z = _mm_set1_ps(inv_direction.z);
+
+	uint32_t mask = 0;
+	for (uint32_t base = 0; base < node.child_count; base += 4)
+	{
+		__m128 const tx0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.min[0][base]), origin_x), inv_direction_x);
+		__m128 const tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.max[0][base]), origin_x), inv_direction_x);
+		__m128 const ty0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.min[1][base]), origin_y), inv_direction_y);
+		__m128 const ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.max[1][base]), origin_y), inv_direction_y);
+		__m128 const tz0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.min[2][base]), origin_z), inv_direction_z);
+		__m128 const tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.max[2][base]), origin_z), inv_direction_z);
+
+		__m128 const t_entry = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+		__m128 const t_exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+
+		_mm_storeu_ps(t_entries + base, t_entry);
+		mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_entry, t_exit))) << base;
+	}
+	return mask & ((1u << node.child_count) - 1);
+}
+
+A_TARGET_AVX uint32_t intersect_ray_wide_node_avx(WideBvhNode const& node, Vec3 const origin, Vec3 const inv_direction, float const t_max, float* const t_entries)
+{
+	__m256 const origin_x = _mm256_set1_ps(origin.x);
+	__m256 const origin_y = _mm256_set1_ps(origin.y);
+	__m256 const origin_z = _mm256_set1_ps(origin.z);
+	__m256 const inv_direction_x = _mm256_set1_ps(inv_direction.x);
+	__m256 const inv_direction_y = _mm256_set1_ps(inv_direction.y);
+	__m256 const inv_direction_z = _mm256_set1_ps(inv_direction.z);
+
+	__m256 const tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min[0]), origin_x), inv_direction_x);
+	__m256 const tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max[0]), origin_x), inv_direction_x);
+	__m256 const ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min[1]), origin_y), inv_direction_y);
+	__m256 const ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max[1]), origin_y), inv_direction_y);
+	__m256 const tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min[2]), origin_z), inv_direction_z);
+	__m256 const tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max[2]), origin_z), inv_direction_z);
+
+	__m256 const t_entry = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+	__m256 const t_exit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+
+	_mm256_storeu_ps(t_entries, t_entry);
+	uint32_t const mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t_entry, t_exit, _CMP_LE_OQ)));
+	return mask & ((1u << node.child_count) - 1);
+}
+
+uint32_t intersect_ray_quantized_node_sse(QuantizedBvhNode const& node, Vec3 const origin, Vec3 const inv_direction, float const t_max, float* const t_entries)
+{
+	float const origins[3] = {origin.x, origin.y, origin.z};
+	float const inv_directions[3] = {inv_direction.x, inv_direction.y, inv_direction.z};
+	__m128i const zero = _mm_setzero_si128();
+
+	__m128 t_entry = _mm_setzero_ps();
+	__m128 t_exit = _mm_set1_ps(t_max);
+	__m128 used = _mm_setzero_ps();
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		// Widen the four 8-bit coordinates to floats and decode them the same way the builder checked them.
+		int min_bytes;
+		int max_bytes;
+		memcpy(&min_bytes, node.min[axis], sizeof(min_bytes));
+		memcpy(&max_bytes, node.max[axis], sizeof(max_bytes));
+		__m128 const q_min = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(min_bytes), zero), zero));
+		__m128 const q_max = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(max_bytes), zero), zero));
+
+		// Unused lanes hold an inverted box, which the slab test alone would take for a full one.
+		if (0 == axis)
+			used = _mm_cmple_ps(q_min, q_max);
+
+		__m128 const grid_origin = _mm_set1_ps(node.origin[axis]);
+		__m128 const grid_scale = _mm_set1_ps(node.scale[axis]);
+		__m128 const ray_origin = _mm_set1_ps(origins[axis]);
+		__m128 const ray_inv_direction = _mm_set1_ps(inv_directions[axis]);
+
+		__m128 const t0 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(grid_origin, _mm_mul_ps(q_min, grid_scale)), ray_origin), ray_inv_direction);
+		__m128 const t1 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(grid_origin, _mm_mul_ps(q_max, grid_scale)), ray_origin), ray_inv_direction);
+		t_entry = _mm_max_ps(_mm_min_ps(t0, t1), t_entry);
+		t_exit = _mm_min_ps(_mm_max_ps(t0, t1), t_exit);
+	}
+
+	_mm_storeu_ps(t_entries, t_entry);
+	return static_cast<uint32_t>(_mm_movemask_ps(_mm_and_ps(used, _mm_cmple_ps(t_entry, t_exit))));
+}
+
+// Both packet kernels are their scalar counterparts run across rays instead of across boxes or triangles.
+
+uint32_t intersect_ray_packet_aabb_sse(RayPacket const& packet, uint32_t const active_mask, Aabb const& box, RayPacketHits const& hits)
+{
+	__m128 const min_x = _mm_set1_ps(box.min.x);
+	__m128 const min_y = _mm_set1_ps(box.min.y);
+	__m128 const min_z = _mm_set1_ps(box.min.z);
+	__m128 const max_x = _mm_set1_ps(box.max.x);
+	__m128 const max_y = _mm_set1_ps(box.max.y);
+	__m128 const max_z = _mm_set1_ps(box.max.z);
+
+	uint32_t mask = 0;
+	for (uint32_t base = 0; base < kRayPacketSize; base += 4)
+	{
+		if (!((active_mask >> base) & 0xf))
+			continue;
+
+		__m128 const origin_x = _mm_loadu_ps(&packet.origin[0][base]);
+		__m128 const origin_y = _mm_loadu_ps(&packet.origin[1][base]);
+		__m128 const origin_z = _mm_loadu_ps(&packet.origin[2][base]);
+		__m128 const inv_direction_x = _mm_loadu_ps(&packet.inv_direction[0][base]);
+		__m128 const inv_direction_y = _mm_loadu_ps(&packet.inv_direction[1][base]);
+		__m128 const inv_direction_z = _mm_loadu_ps(&packet.inv_direction[2][base]);
+
+		__m128 const tx0 = _mm_mul_ps(_mm_sub_ps(min_x, origin_x), inv_direction_x);
+		__m128 const tx1 = _mm_mul_ps(_mm_sub_ps(max_x, origin_x), inv_direction_x);
+		__m128 const ty0 = _mm_mul_ps(_mm_sub_ps(min_y, origin_y), inv_direction_y);
+		__m128 const ty1 = _mm_mul_ps(_mm_sub_ps(max_y, origin_y), inv_direction_y);
+		__m128 const tz0 = _mm_mul_ps(_mm_sub_ps(min_z, origin_z), inv_direction_z);
+		__m128 const tz1 = _mm_mul_ps(_mm_sub_ps(max_z, origin_z), inv_direction_z);
+
+		__m128 const t_entry = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+		__m128 const t_exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_loadu_ps(&hits.t[base])));
+
+		mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_entry, t_exit))) << base;
+	}
+	return mask & active_mask;
+}
+
+A_TARGET_AVX uint32_t intersect_ray_packet_aabb_avx(RayPacket const& packet, uint32_t const active_mask, Aabb const& box, RayPacketHits const& hits)
+{
+	__m256 const origin_x = _mm256_loadu_ps(packet.origin[0]);
+	__m256 const origin_y = _mm256_loadu_ps(packet.origin[1]);
+	__m256 const origin_z = _mm256_loadu_ps(packet.origin[2]);
+	__m256 const inv_direction_x = _mm256_loadu_ps(packet.inv_direction[0]);
+	__m256 const inv_direction_y = _mm256_loadu_ps(packet.inv_direction[1]);
+	__m256 const inv_direction_z = _mm256_loadu_ps(packet.inv_direction[2]);
+
+	__m256 const tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.x), origin_x), inv_direction_x);
+	__m256 const tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.x), origin_x), inv_direction_x);
+	__m256 const ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.y), origin_y), inv_direction_y);
+	__m256 const ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.y), origin_y), inv_direction_y);
+	__m256 const tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.z), origin_z), inv_direction_z);
+	__m256 const tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.z), origin_z), inv_direction_z);
+
+	__m256 const t_entry = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+	__m256 const t_exit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_loadu_ps(hits.t)));
+
+	return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t_entry, t_exit, _CMP_LE_OQ))) & active_mask;
+}
+
+void intersect_ray_packet_triangle_sse(RayPacket const& packet, uint32_t const active_mask, uint32_t const triangle_index, TriangleRecord const& triangle, RayPacketHits& hits)
+{
+	__m128 const a_x = _mm_set1_ps(triangle.a.x);
+	__m128 const a_y = _mm_set1_ps(triangle.a.y);
+	__m128 const a_z = _mm_set1_ps(triangle.a.z);
+	__m128 const n_x = _mm_set1_ps(triangle.n.x);
+	__m128 const n_y = _mm_set1_ps(triangle.n.y);
+	__m128 const n_z = _mm_set1_ps(triangle.n.z);
+	__m128 const zero = _mm_setzero_ps();
+
+	for (uint32_t base = 0; base < kRayPacketSize; base += 4)
+	{
+		int const lane_mask = static_cast<int>((active_mask >> base) & 0xf);
+		if (!lane_mask)
+			continue;
+
+		__m128 const qp_x = _mm_sub_ps(zero, _mm_loadu_ps(&packet.direction[0][base]));
+		__m128 const qp_y = _mm_sub_ps(zero, _mm_loadu_ps(&packet.direction[1][base]));
+		__m128 const qp_z = _mm_sub_ps(zero, _mm_loadu_ps(&packet.direction[2][base]));
+
+		__m128 const d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qp_x, n_x), _mm_mul_ps(qp_y, n_y)), _mm_mul_ps(qp_z, n_z));
+
+		__m128 const ap_x = _mm_sub_ps(_mm_loadu_ps(&packet.origin[0][base]), a_x);
+		__m128 const ap_y = _mm_sub_ps(_mm_loadu_ps(&packet.origin[1][base]), a_y);
+		__m128 const ap_z = _mm_sub_ps(_mm_loadu_ps(&packet.origin[2][base]), a_z);
+
+		__m128 const t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ap_x, n_x), _mm_mul_ps(ap_y, n_y)), _mm_mul_ps(ap_z, n_z));
+
+		__m128 const e_x = _mm_sub_ps(_mm_mul_ps(qp_y, ap_z), _mm_mul_ps(qp_z, ap_y));
+		__m128 const e_y = _mm_sub_ps(_mm_mul_ps(qp_z, ap_x), _mm_mul_ps(qp_x, ap_z));
+		__m128 const e_z = _mm_sub_ps(_mm_mul_ps(qp_x, ap_y), _mm_mul_ps(qp_y, ap_x));
+
+		__m128 const v = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_set1_ps(triangle.ac.x), e_x),
+			_mm_mul_ps(_mm_set1_ps(triangle.ac.y), e_y)),
+			_mm_mul_ps(_mm_set1_ps(triangle.ac.z), e_z));
+		__m128 const w = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_set1_ps(triangle.ab.x), e_x),
+			_mm_mul_ps(_mm_set1_ps(triangle.ab.y), e_y)),
+			_mm_mul_ps(_mm_set1_ps(triangle.ab.z), e_z)));
+
+		__m128 mask = _mm_cmpgt_ps(d, zero);
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+		mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_mul_ps(_mm_loadu_ps(&hits.t[base]), d)));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(v, d));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(w, zero));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(v, w), d));
+
+		int const hit_mask = _mm_movemask_ps(mask) & lane_mask;
+		if (!hit_mask)
+			continue;
+
+		float lane_t[4];
+		float lane_v[4];
+		float lane_w[4];
+		float lane_d[4];
+		_mm_storeu_ps(lane_t, t);
+		_mm_storeu_ps(lane_v, v);
+		_mm_storeu_ps(lane_w, w);
+		_mm_storeu_ps(lane_d, d);
+
+		for (uint32_t lane = 0; lane < 4; ++lane)
+		{
+			if (!(hit_mask & (1 << lane)))
+				continue;
+
+			float const ood = 1.f / lane_d[lane];
+			hits.t[base + lane] = lane_t[lane] * ood;
+			hits.v[base + lane] = lane_v[lane] * ood;
+			hits.w[base + lane] = lane_w[lane] * ood;
+			hits.triangle_index[base + lane] = triangle_index;
+		}
+	}
+}
+
+A_TARGET_AVX void intersect_ray_packet_triangle_avx(RayPacket const& packet, uint32_t const active_mask, uint32_t const triangle_index, TriangleRecord const& triangle, RayPacketHits& hits)
+{
+	__m256 const zero = _mm256_setzero_ps();
+	__m256 const n_x = _mm256_set1_ps(triangle.n.x);
+	__m256 const n_y = _mm256_set1_ps(triangle.n.y);
+	__m256 const n_z = _mm256_set1_ps(triangle.n.z);
+
+	__m256 const qp_x = _mm256_sub_ps(zero, _mm256_loadu_ps(packet.direction[0]));
+	__m256 const qp_y = _mm256_sub_ps(zero, _mm256_loadu_ps(packet.direction[1]));
+	__m256 const qp_z = _mm256_sub_ps(zero, _mm256_loadu_ps(packet.direction[2]));
+
+	__m256 const d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qp_x, n_x), _mm256_mul_ps(qp_y, n_y)), _mm256_mul_ps(qp_z, n_z));
+
+	__m256 const ap_x = _mm256_sub_ps(_mm256_loadu_ps(packet.origin[0]), _mm256_set1_ps(triangle.a.x));
+	__m256 const ap_y = _mm256_sub_ps(_mm256_loadu_ps(packet.origin[1]), _mm256_set1_ps(triangle.a.y));
+	__m256 const ap_z = _mm256_sub_ps(_mm256_loadu_ps(packet.origin[2]), _mm256_set1_ps(triangle.a.z));
+
+	__m256 const t = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ap_x, n_x), _mm256_mul_ps(ap_y, n_y)), _mm256_mul_ps(ap_z, n_z));
+
+	__m256 const e_x = _mm256_sub_ps(_mm256_mul_ps(qp_y, ap_z), _mm256_mul_ps(qp_z, ap_y));
+	__m256 const e_y = _mm256_sub_ps(_mm256_mul_ps(qp_z, ap_x), _mm256_mul_ps(qp_x, ap_z));
+	__m256 const e_z = _mm256_sub_ps(_mm256_mul_ps(qp_x, ap_y), _mm256_mul_ps(qp_y, ap_x));
+
+	__m256 const v = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(_mm256_set1_ps(triangle.ac.x), e_x),
+		_mm256_mul_ps(_mm256_set1_ps(triangle.ac.y), e_y)),
+		_mm256_mul_ps(_mm256_set1_ps(triangle.ac.z), e_z));
+	__m256 const w = _mm256_sub_ps(zero, _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(_mm256_set1_ps(triangle.ab.x), e_x),
+		_mm256_mul_ps(_mm256_set1_ps(triangle.ab.y), e_y)),
+		_mm256_mul_ps(_mm256_set1_ps(triangle.ab.z), e_z)));
+
+	__m256 const t_max = _mm256_loadu_ps(hits.t);
+	__m256 mask = _mm256_cmp_ps(d, zero, _CMP_GT_OQ);
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_mul_ps(t_max, d), _CMP_LT_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, d, _CMP_LE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(w, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(v, w), d, _CMP_LE_OQ));
+
+	int32_t active_lanes[kRayPacketSize];
+	for (uint32_t lane = 0; lane < kRayPacketSize; ++lane)
+	{
+		active_lanes[lane] = (active_mask & (1u << lane)) ? -1 : 0;
+	}
+	__m256 const blend = _mm256_and_ps(mask, _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(active_lanes))));
+
+	int const hit_mask = _mm256_movemask_ps(blend);
+	if (!hit_mask)
+		return;
+
+	// Every lane that hit needs its own division, so do them all at once and blend the winners in.
+	__m256 const ood = _mm256_div_ps(_mm256_set1_ps(1.f), d);
+	_mm256_storeu_ps(hits.t, _mm256_blendv_ps(t_max, _mm256_mul_ps(t, ood), blend));
+	_mm256_storeu_ps(hits.v, _mm256_blendv_ps(_mm256_loadu_ps(hits.v), _mm256_mul_ps(v, ood), blend));
+	_mm256_storeu_ps(hits.w, _mm256_blendv_ps(_mm256_loadu_ps(hits.w), _mm256_mul_ps(w, ood), blend));
+	for (uint32_t lane = 0; lane < kRayPacketSize; ++lane)
+	{
+		if (hit_mask & (1 << lane))
+			hits.triangle_index[lane] = triangle_index;
+	}
+}
+
+// Both triangle kernels are the scalar intersect_ray_triangle run across lanes: every lane is tested against values
+// scaled by its d, and only the nearest accepted lane pays for the division into t, v and w.
+
+TriangleHit intersect_ray_triangle_block_sse(Ray const ray, float const t_max, TriangleBlock const& block)
+{
+	__m128 const qp_x = _mm_set1_ps(-ray.direction.x);
+	__m128 const qp_y = _mm_set1_ps(-ray.direction.y);
+	__m128 const qp_z = _mm_set1_ps(-ray.direction.z);
+	__m128 const origin_x = _mm_set1_ps(ray.origin.x);
+	__m128 const origin_y = _mm_set1_ps(ray.origin.y);
+	__m128 const origin_z = _mm_set1_ps(ray.origin.z);
+	__m128 const zero = _mm_setzero_ps();
+
+	TriangleHit hit;
+	float nearest_t = t_max;
+
+	for (uint32_t base = 0; base < block.count; base += 4)
+	{
+		__m128 const n_x = _mm_loadu_ps(&block.n[0][base]);
+		__m128 const n_y = _mm_loadu_ps(&block.n[1][base]);
+		__m128 const n_z = _mm_loadu_ps(&block.n[2][base]);
+
+		__m128 const d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qp_x, n_x), _mm_mul_ps(qp_y, n_y)), _mm_mul_ps(qp_z, n_z));
+
+		__m128 const ap_x = _mm_sub_ps(origin_x, _mm_loadu_ps(&block.a[0][base]));
+		__m128 const ap_y = _mm_sub_ps(origin_y, _mm_loadu_ps(&block.a[1][base]));
+		__m128 const ap_z = _mm_sub_ps(origin_z, _mm_loadu_ps(&block.a[2][base]));
+
+		__m128 const t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ap_x, n_x), _mm_mul_ps(ap_y, n_y)), _mm_mul_ps(ap_z, n_z));
+
+		__m128 const e_x = _mm_sub_ps(_mm_mul_ps(qp_y, ap_z), _mm_mul_ps(qp_z, ap_y));
+		__m128 const e_y = _mm_sub_ps(_mm_mul_ps(qp_z, ap_x), _mm_mul_ps(qp_x, ap_z));
+		__m128 const e_z = _mm_sub_ps(_mm_mul_ps(qp_x, ap_y), _mm_mul_ps(qp_y, ap_x));
+
+		__m128 const v = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_loadu_ps(&block.ac[0][base]), e_x),
+			_mm_mul_ps(_mm_loadu_ps(&block.ac[1][base]), e_y)),
+			_mm_mul_ps(_mm_loadu_ps(&block.ac[2][base]), e_z));
+		__m128 const w = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_loadu_ps(&block.ab[0][base]), e_x),
+			_mm_mul_ps(_mm_loadu_ps(&block.ab[1][base]), e_y)),
+			_mm_mul_ps(_mm_loadu_ps(&block.ab[2][base]), e_z)));
+
+		__m128 mask = _mm_cmpgt_ps(d, zero);
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+		mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_mul_ps(_mm_set1_ps(nearest_t), d)));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(v, d));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(w, zero));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(v, w), d));
+
+		int lane_mask = _mm_movemask_ps(mask);
+		if (!lane_mask)
+			continue;
+
+		float lane_t[4];
+		float lane_d[4];
+		_mm_storeu_ps(lane_t, t);
+		_mm_storeu_ps(lane_d, d);
+
+		// Compare accepted lanes by cross-multiplying instead of dividing each one.
+		int nearest_lane = -1;
+		for (int lane = 0; lane_mask; ++lane, lane_mask >>= 1)
+		{
+			if ((lane_mask & 1) && (nearest_lane < 0 || lane_t[lane] * lane_d[nearest_lane] < lane_t[nearest_lane] * lane_d[lane]))
+				nearest_lane = lane;
+		}
+
+		float lane_v[4];
+		float lane_w[4];
+		_mm_storeu_ps(lane_v, v);
+		_mm_storeu_ps(lane_w, w);
+
+		float const ood = 1.f / lane_d[nearest_lane];
+		hit.triangle_index = block.triangle_index[base + nearest_lane];
+		hit.t = lane_t[nearest_lane] * ood;
+		hit.v = lane_v[nearest_lane] * ood;
+		hit.w = lane_w[nearest_lane] * ood;
+		nearest_t = hit.t;
+	}
+
+	return hit;
+}
+
+A_TARGET_AVX TriangleHit intersect_ray_triangle_block_avx(Ray const ray, float const t_max, TriangleBlock const& block)
+{
+	__m256 const qp_x = _mm256_set1_ps(-ray.direction.x);
+	__m256 const qp_y = _mm256_set1_ps(-ray.direction.y);
+	__m256 const qp_z = _mm256_set1_ps(-ray.direction.z);
+	__m256 const zero = _mm256_setzero_ps();
+
+	__m256 const n_x = _mm256_loadu_ps(block.n[0]);
+	__m256 const n_y = _mm256_loadu_ps(block.n[1]);
+	__m256 const n_z = _mm256_loadu_ps(block.n[2]);
+
+	__m256 const d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qp_x, n_x), _mm256_mul_ps(qp_y, n_y)), _mm256_mul_ps(qp_z, n_z));
+
+	__m256 const ap_x = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(block.a[0]));
+	__m256 const ap_y = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(block.a[1]));
+	__m256 const ap_z = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(block.a[2]));
+
+	__m256 const t = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ap_x, n_x), _mm256_mul_ps(ap_y, n_y)), _mm256_mul_ps(ap_z, n_z));
+
+	__m256 const e_x = _mm256_sub_ps(_mm256_mul_ps(qp_y, ap_z), _mm256_mul_ps(qp_z, ap_y));
+	__m256 const e_y = _mm256_sub_ps(_mm256_mul_ps(qp_z, ap_x), _mm256_mul_ps(qp_x, ap_z));
+	__m256 const e_z = _mm256_sub_ps(_mm256_mul_ps(qp_x, ap_y), _mm256_mul_ps(qp_y, ap_x));
+
+	__m256 const v = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(_mm256_loadu_ps(block.ac[0]), e_x),
+		_mm256_mul_ps(_mm256_loadu_ps(block.ac[1]), e_y)),
+		_mm256_mul_ps(_mm256_loadu_ps(block.ac[2]), e_z));
+	__m256 const w = _mm256_sub_ps(zero, _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(_mm256_loadu_ps(block.ab[0]), e_x),
+		_mm256_mul_ps(_mm256_loadu_ps(block.ab[1]), e_y)),
+		_mm256_mul_ps(_mm256_loadu_ps(block.ab[2]), e_z)));
+
+	__m256 mask = _mm256_cmp_ps(d, zero, _CMP_GT_OQ);
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_mul_ps(_mm256_set1_ps(t_max), d), _CMP_LT_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, d, _CMP_LE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(w, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(v, w), d, _CMP_LE_OQ));
+
+	int lane_mask = _mm256_movemask_ps(mask);
+	if (!lane_mask)
+		return TriangleHit();
+
+	float lane_t[8];
+	float lane_d[8];
+	_mm256_storeu_ps(lane_t, t);
+	_mm256_storeu_ps(lane_d, d);
+
+	int nearest_lane = -1;
+	for (int lane = 0; lane_mask; ++lane, lane_mask >>= 1)
+	{
+		if ((lane_mask & 1) && (nearest_lane < 0 || lane_t[lane] * lane_d[nearest_lane] < lane_t[nearest_lane] * lane_d[lane]))
+			nearest_lane = lane;
+	}
+
+	float lane_v[8];
+	float lane_w[8];
+	_mm256_storeu_ps(lane_v, v);
+	_mm256_storeu_ps(lane_w, w);
+
+	float const ood = 1.f / lane_d[nearest_lane];
+
+	TriangleHit hit;
+	hit.triangle_index = block.triangle_index[nearest_lane];
+	hit.t = lane_t[nearest_lane] * ood;
+	hit.v = lane_v[nearest_lane] * ood;
+	hit.w = lane_w[nearest_lane] * ood;
+	return hit;
+}
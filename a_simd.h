@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "a_geom.h"
+
+uint32_t const kTriangleBlockSize = 8;
+
+// Triangle records for up to eight triangles in SoA form; unused lanes have a zero normal and never hit.
+struct TriangleBlock
+{
+	float a[3][kTriangleBlockSize];
+	float ab[3][kTriangleBlockSize];
+	float ac[3][kTriangleBlockSize];
+	float n[3][kTriangleBlockSize];
+	uint32_t triangle_index[kTriangleBlockSize];
+	uint32_t count;
+};
+
+uint32_t const kWideBvhMaxWidth = 8;
+uint32_t const kWideBvhLeafFlag = 0x80000000u;
+
+// Child bounds of a collapsed BVH node in SoA form; children fill the first child_count lanes.
+struct WideBvhNode
+{
+	float min[3][kWideBvhMaxWidth];
+	float max[3][kWideBvhMaxWidth];
+	uint32_t children[kWideBvhMaxWidth]; // wide node index, or binary leaf node index with kWideBvhLeafFlag set
+	uint32_t child_count;
+};
+
+uint32_t const kQuantizedBvhWidth = 4;
+
+// A 4-wide node in one cache line: child bounds are 8-bit coordinates on a grid spanning the node, rounded outwards.
+struct QuantizedBvhNode
+{
+	float origin[3];
+	float scale[3]; // grid step per axis
+	uint8_t min[3][kQuantizedBvhWidth];
+	uint8_t max[3][kQuantizedBvhWidth];
+	uint32_t children[kQuantizedBvhWidth]; // as in WideBvhNode
+};
+
+static_assert(sizeof(QuantizedBvhNode) == 64, "quantized BVH nodes should fill a cache line");
+
+uint32_t const kRayPacketSize = 8;
+
+// Coherent rays traced together in SoA form, so each node and triangle fetched is tested against all of them at once.
+struct RayPacket
+{
+	float origin[3][kRayPacketSize];
+	float direction[3][kRayPacketSize];
+	float inv_direction[3][kRayPacketSize];
+};
+
+// Closest hits of a packet, one lane per ray; t starts out as each ray's t_max.
+struct RayPacketHits
+{
+	float t[kRayPacketSize];
+	float v[kRayPacketSize];
+	float w[kRayPacketSize];
+	uint32_t triangle_index[kRayPacketSize];
+};
+
+// Decode one grid coordinate with exactly the rounding the node kernel uses.
+float decode_quantized_bound(float origin, float scale, uint32_t q);
+
+void* allocate_cache_aligned(size_t size);
+void free_cache_aligned(void* memory);
+
+bool cpu_supports_avx();
+uint32_t detect_simd_width();
+
+void clear_triangle_block(TriangleBlock& block);
+void set_triangle_block_lane(TriangleBlock& block, uint32_t lane, uint32_t triangle_index, TriangleRecord const& triangle);
+
+// Return a mask of the children the ray enters before t_max, writing each one's entry distance.
+uint32_t intersect_ray_wide_node_sse(WideBvhNode const& node, Vec3 origin, Vec3 inv_direction, float t_max, float* t_entries);
+uint32_t intersect_ray_wide_node_avx(WideBvhNode const& node, Vec3 origin, Vec3 inv_direction, float t_max, float* t_entries);
+
+uint32_t intersect_ray_quantized_node_sse(QuantizedBvhNode const& node, Vec3 origin, Vec3 inv_direction, float t_max, float* t_entries);
+
+// Return a mask of the rays in active_mask that enter the box before their current hit.
+uint32_t intersect_ray_packet_aabb_sse(RayPacket const& packet, uint32_t active_mask, Aabb const& box, RayPacketHits const& hits);
+uint32_t intersect_ray_packet_aabb_avx(RayPacket const& packet, uint32_t active_mask, Aabb const& box, RayPacketHits const& hits);
+
+// Test the rays in active_mask against one triangle, keeping whichever hits are nearer.
+void intersect_ray_packet_triangle_sse(RayPacket const& packet, uint32_t active_mask, uint32_t triangle_index, TriangleRecord const& triangle, RayPacketHits& hits);
+void intersect_ray_packet_triangle_avx(RayPacket const& packet, uint32_t active_mask, uint32_t triangle_index, TriangleRecord const& triangle, RayPacketHits& hits);
+
+TriangleHit intersect_ray_triangle_block_sse(Ray ray, float t_max, TriangleBlock const& block);
+TriangleHit intersect_ray_triangle_block_avx(Ray ray, float t_max, TriangleBlock const& block);
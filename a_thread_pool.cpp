@@ -0,0 +1,167 @@
+#include "a_thread_pool.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct TaskQueue
+{
+	std::mutex mutex;
+	std::deque<uint32_t> task_indices;
+};
+
+struct ThreadPool
+{
+	uint32_t thread_count;
+	std::vector<std::thread> threads; // all but the caller's
+	std::vector<TaskQueue> queues; // one per thread, the caller's first
+
+	std::mutex mutex;
+	std::condition_variable job_started;
+	std::condition_variable job_finished;
+	std::function<void(uint32_t, uint32_t)> const* task;
+	uint64_t job_count; // jobs started, so a waking thread can tell a new job from a spurious wakeup
+	uint32_t busy_thread_count;
+	bool quit;
+};
+
+bool pop_own_task(TaskQueue& queue, uint32_t& task_index)
+{
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.task_indices.empty())
+		return false;
+	task_index = queue.task_indices.front();
+	queue.task_indices.pop_front();
+	return true;
+}
+
+// Thieves take from the back, away from where the owner is working, which keeps the owner's tasks neighbouring ones.
+bool steal_task(TaskQueue& queue, uint32_t& task_index)
+{
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.task_indices.empty())
+		return false;
+	task_index = queue.task_indices.back();
+	queue.task_indices.pop_back();
+	return true;
+}
+
+// No tasks are added while a job runs, so once every queue is empty this thread is done.
+void run_queued_tasks(ThreadPool& pool, uint32_t const thread_index)
+{
+	std::function<void(uint32_t, uint32_t)> const& task = *pool.task;
+	for (;;)
+	{
+		uint32_t task_index;
+		bool found = pop_own_task(pool.queues[thread_index], task_index);
+		for (uint32_t offset = 1; !found && offset < pool.thread_count; ++offset)
+		{
+			found = steal_task(pool.queues[(thread_index + offset) % pool.thread_count], task_index);
+		}
+		if (!found)
+			return;
+
+		task(thread_index, task_index);
+	}
+}
+
+void run_pool_thread(ThreadPool& pool, uint32_t const thread_index)
+{
+	uint64_t jobs_done = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			pool.job_started.wait(lock, [&]() { return pool.quit || pool.job_count != jobs_done; });
+			if (pool.quit)
+				return;
+			jobs_done = pool.job_count;
+		}
+
+		run_queued_tasks(pool, thread_index);
+
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		if (--pool.busy_thread_count == 0)
+			pool.job_finished.notify_one();
+	}
+}
+
+ThreadPool* create_thread_pool(uint32_t const thread_count)
+{
+	ThreadPool* const pool = new ThreadPool();
+	pool->thread_count = (thread_count > 0) ? thread_count : 1;
+	pool->queues = std::vector<TaskQueue>(pool->thread_count);
+	pool->task = nullptr;
+	pool->job_count = 0;
+	pool->busy_thread_count = 0;
+	pool->quit = false;
+
+	pool->threads.reserve(pool->thread_count - 1);
+	for (uint32_t thread_index = 1; thread_index < pool->thread_count; ++thread_index)
+	{
+		pool->threads.emplace_back(run_pool_thread, std::ref(*pool), thread_index);
+	}
+	return pool;
+}
+
+void destroy_thread_pool(ThreadPool* const pool)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->quit = true;
+	}
+	pool->job_started.notify_all();
+	for (std::thread& thread : pool->threads)
+	{
+		thread.join();
+	}
+	delete pool;
+}
+
+uint32_t thread_pool_size(ThreadPool const& pool)
+{
+	return pool.thread_count;
+}
+
+void run_thread_pool_tasks(ThreadPool& pool, uint32_t const task_count, std::function<void(uint32_t, uint32_t)> const& task)
+{
+	for (uint32_t thread_index = 0; thread_index < pool.thread_count; ++thread_index)
+	{
+		TaskQueue& queue = pool.queues[thread_index];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		uint32_t const first = static_cast<uint32_t>(uint64_t(task_count) * thread_index / pool.thread_count);
+		uint32_t const last = static_cast<uint32_t>(uint64_t(task_count) * (thread_index + 1) / pool.thread_count);
+		for (uint32_t task_index = first; task_index < last; ++task_index)
+		{
+			queue.task_indices.push_back(task_index);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.task = &task;
+		pool.busy_thread_count = pool.thread_count - 1;
+		++pool.job_count;
+	}
+	pool.job_started.notify_all();
+
+	run_queued_tasks(pool, 0);
+
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	pool.job_finished.wait(lock, [&]() { return pool.busy_thread_count == 0; });
+	pool.task = nullptr;
+}
+
+void run_thread_pool_chunks(ThreadPool& pool, uint32_t const begin, uint32_t const end, std::function<void(uint32_t, uint32_t, uint32_t)> const& function)
+{
+	uint32_t const chunk_count = pool.thread_count;
+	uint64_t const count = end - begin;
+	run_thread_pool_tasks(pool, chunk_count, [&](uint32_t, uint32_t const chunk_index)
+	{
+		uint32_t const chunk_begin = begin + static_cast<uint32_t>(count * chunk_index / chunk_count);
+		uint32_t const chunk_end = begin + static_cast<uint32_t>(count * (chunk_index + 1) / chunk_count);
+		function(chunk_index, chunk_begin, chunk_end);
+	});
+}
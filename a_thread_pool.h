@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+
+// Threads that stay alive from one job to the next. A job's tasks are dealt out in contiguous runs to one queue per
+// thread; each thread works through its own queue from the front and, once it runs dry, steals from the back of the
+// others, so every thread stays busy until the last task.
+struct ThreadPool;
+
+// The calling thread counts as one of thread_count and works on the jobs it runs.
+ThreadPool* create_thread_pool(uint32_t thread_count);
+void destroy_thread_pool(ThreadPool* pool);
+
+uint32_t thread_pool_size(ThreadPool const& pool);
+
+// Call task(thread_index, task_index) for every task_index in [0, task_count), returning once all of them are done.
+void run_thread_pool_tasks(ThreadPool& pool, uint32_t task_count, std::function<void(uint32_t, uint32_t)> const& task);
+
+// Call function(chunk_index, chunk_begin, chunk_end) for thread_pool_size(pool) contiguous chunks of [begin, end), some of
+// them empty when the range is short, returning once all of them are done.
+void run_thread_pool_chunks(ThreadPool& pool, uint32_t begin, uint32_t end, std::function<void(uint32_t, uint32_t, uint32_t)> const& function);
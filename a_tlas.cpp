@@ -0,0 +1,303 @@
+#include "a_tlas.h"
+
+#include <float.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+uint32_t const kTlasMaxDepth = 64;
+
+Instance make_instance(uint32_t const blas_index, Mat34 const& object_to_world)
+{
+	Instance instance;
+	instance.blas_index = blas_index;
+	instance.object_to_world = object_to_world;
+	instance.world_to_object = inverse(object_to_world);
+	return instance;
+}
+
+Aabb transform_bounds(Mat34 const& transform, Aabb const& bounds)
+{
+	Aabb world_bounds;
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		Vec3 const point((corner & 1) ? bounds.max.x : bounds.min.x, (corner & 2) ? bounds.max.y : bounds.min.y, (corner & 4) ? bounds.max.z : bounds.min.z);
+		world_bounds = aabb_union(world_bounds, transform_point(transform, point));
+	}
+	return world_bounds;
+}
+
+Tlas build_tlas(uint32_t const blas_count, Blas const* const blases, uint32_t const instance_count, Instance const* const instances)
+{
+	std::vector<Aabb> instance_bounds(instance_count);
+	for (uint32_t instance_index = 0; instance_index < instance_count; ++instance_index)
+	{
+		Instance const& instance = instances[instance_index];
+		Bvh const& blas_bvh = blases[instance.blas_index].bvh;
+		if (blas_bvh.node_count)
+			instance_bounds[instance_index] = transform_bounds(instance.object_to_world, blas_bvh.nodes[0].bounds);
+	}
+
+	Tlas tlas = {};
+	tlas.blas_count = blas_count;
+	tlas.instance_count = instance_count;
+	tlas.blases = blases;
+	tlas.instances = instances;
+	tlas.bvh = build_bvh(instance_count, instance_bounds.data(), 1, nullptr);
+	return tlas;
+}
+
+// The direction is not renormalized, so distances along the ray are the same in both spaces.
+Ray world_to_object_ray(Instance const& instance, Ray const ray)
+{
+	Ray object_ray = ray;
+	object_ray.origin = transform_point(instance.world_to_object, ray.origin);
+	object_ray.direction = transform_vector(instance.world_to_object, ray.direction);
+	return object_ray;
+}
+
+struct TlasStackEntry
+{
+	uint32_t node_index;
+	float t_entry;
+};
+
+InstanceHit intersect_tlas(Tlas const& tlas, Ray const ray, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	InstanceHit hit;
+	hit.instance_index = 0;
+
+	Bvh const& bvh = tlas.bvh;
+	if (!bvh.node_count)
+		return hit;
+
+	BvhNode const* const nodes = bvh.nodes;
+	Vec3 const origin = ray.origin;
+	Vec3 const inv_direction(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+
+	TlasStackEntry stack[kTlasMaxDepth];
+	uint32_t stack_size = 0;
+
+	if (FLT_MAX == intersect_ray_aabb(nodes[0].bounds, origin, inv_direction, hit.triangle.t))
+		return hit;
+
+	uint32_t node_index = 0;
+	for (;;)
+	{
+		BvhNode const& node = nodes[node_index];
+		COUNT_BVH_NODE_FETCH();
+		if (node.count)
+		{
+			for (uint32_t i = 0; i < node.count; ++i)
+			{
+				uint32_t const instance_index = bvh.primitive_indices[node.index + i];
+				Instance const& instance = tlas.instances[instance_index];
+				Blas const& blas = tlas.blases[instance.blas_index];
+
+				TriangleHit const blas_hit = intersect_bvh(blas.bvh, world_to_object_ray(instance, ray), hit.triangle.t, indices + 3u * blas.triangle_index, vertices);
+				if (blas_hit.valid())
+				{
+					hit.triangle = blas_hit;
+					hit.triangle.triangle_index += blas.triangle_index;
+					hit.instance_index = instance_index;
+				}
+			}
+		}
+		else
+		{
+			uint32_t near_index = node.index + 0;
+			uint32_t far_index = node.index + 1;
+			float t_near = intersect_ray_aabb(nodes[near_index].bounds, origin, inv_direction, hit.triangle.t);
+			float t_far = intersect_ray_aabb(nodes[far_index].bounds, origin, inv_direction, hit.triangle.t);
+			if (t_far < t_near)
+			{
+				std::swap(near_index, far_index);
+				std::swap(t_near, t_far);
+			}
+
+			if (FLT_MAX != t_near)
+			{
+				if (FLT_MAX != t_far)
+				{
+					stack[stack_size].node_index = far_index;
+					stack[stack_size].t_entry = t_far;
+					stack_size++;
+				}
+				node_index = near_index;
+				continue;
+			}
+		}
+
+		for (;;)
+		{
+			if (!stack_size)
+				return hit;
+			TlasStackEntry const& entry = stack[--stack_size];
+			if (entry.t_entry < hit.triangle.t)
+			{
+				node_index = entry.node_index;
+				break;
+			}
+		}
+	}
+}
+
+bool occluded_tlas(Tlas const& tlas, Ray const ray, float const t_max, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	Bvh const& bvh = tlas.bvh;
+	if (!bvh.node_count)
+		return false;
+
+	BvhNode const* const nodes = bvh.nodes;
+	Vec3 const origin = ray.origin;
+	Vec3 const inv_direction(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+
+	uint32_t stack[kTlasMaxDepth];
+	uint32_t stack_size = 0;
+
+	if (FLT_MAX == intersect_ray_aabb(nodes[0].bounds, origin, inv_direction, t_max))
+		return false;
+
+	uint32_t node_index = 0;
+	for (;;)
+	{
+		BvhNode const& node = nodes[node_index];
+		COUNT_BVH_NODE_FETCH();
+		if (node.count)
+		{
+			for (uint32_t i = 0; i < node.count; ++i)
+			{
+				Instance const& instance = tlas.instances[bvh.primitive_indices[node.index + i]];
+				Blas const& blas = tlas.blases[instance.blas_index];
+				if (occluded_bvh(blas.bvh, world_to_object_ray(instance, ray), t_max, indices + 3u * blas.triangle_index, vertices))
+					return true;
+			}
+		}
+		else
+		{
+			bool const hit_left = FLT_MAX != intersect_ray_aabb(nodes[node.index + 0].bounds, origin, inv_direction, t_max);
+			bool const hit_right = FLT_MAX != intersect_ray_aabb(nodes[node.index + 1].bounds, origin, inv_direction, t_max);
+			if (hit_left)
+			{
+				if (hit_right)
+					stack[stack_size++] = node.index + 1;
+				node_index = node.index + 0;
+				continue;
+			}
+			if (hit_right)
+			{
+				node_index = node.index + 1;
+				continue;
+			}
+		}
+
+		if (!stack_size)
+			return false;
+		node_index = stack[--stack_size];
+	}
+}
+
+RayPacket world_to_object_packet(Instance const& instance, RayPacket const& packet)
+{
+	RayPacket object_packet;
+	for (uint32_t lane = 0; lane < kRayPacketSize; ++lane)
+	{
+		Vec3 const origin = transform_point(instance.world_to_object, Vec3(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]));
+		Vec3 const direction = transform_vector(instance.world_to_object, Vec3(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]));
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			object_packet.origin[axis][lane] = element(origin, axis);
+			object_packet.direction[axis][lane] = element(direction, axis);
+			object_packet.inv_direction[axis][lane] = 1.f / element(direction, axis);
+		}
+	}
+	return object_packet;
+}
+
+struct TlasPacketStackEntry
+{
+	uint32_t node_index;
+	uint32_t active_mask;
+};
+
+void intersect_tlas_packet(Tlas const& tlas, RayPacket const& packet, uint32_t const active_mask, RayPacketHits& hits, uint32_t* const instance_indices,
+	uint32_t const* const indices, Vec3 const* const vertices)
+{
+	Bvh const& bvh = tlas.bvh;
+	if (!bvh.node_count || !active_mask)
+		return;
+
+	static bool const use_avx = cpu_supports_avx();
+	BvhNode const* const nodes = bvh.nodes;
+
+	TlasPacketStackEntry stack[kTlasMaxDepth + 1];
+	uint32_t stack_size = 0;
+	stack[stack_size].node_index = 0;
+	stack[stack_size].active_mask = active_mask;
+	stack_size++;
+
+	while (stack_size)
+	{
+		TlasPacketStackEntry const entry = stack[--stack_size];
+		BvhNode const& node = nodes[entry.node_index];
+		COUNT_BVH_NODE_FETCH();
+
+		uint32_t const node_mask = (use_avx)
+			? intersect_ray_packet_aabb_avx(packet, entry.active_mask, node.bounds, hits)
+			: intersect_ray_packet_aabb_sse(packet, entry.active_mask, node.bounds, hits);
+		if (!node_mask)
+			continue;
+
+		if (node.count)
+		{
+			for (uint32_t i = 0; i < node.count; ++i)
+			{
+				uint32_t const instance_index = bvh.primitive_indices[node.index + i];
+				Instance const& instance = tlas.instances[instance_index];
+				Blas const& blas = tlas.blases[instance.blas_index];
+
+				// Distances carry over between spaces, so the hits can be shared; the lanes that got nearer are this instance's.
+				float t_before[kRayPacketSize];
+				memcpy(t_before, hits.t, sizeof(t_before));
+				intersect_bvh_packet(blas.bvh, world_to_object_packet(instance, packet), node_mask, hits, indices + 3u * blas.triangle_index, vertices);
+				for (uint32_t lane = 0; lane < kRayPacketSize; ++lane)
+				{
+					if (hits.t[lane] < t_before[lane])
+					{
+						hits.triangle_index[lane] += blas.triangle_index;
+						instance_indices[lane] = instance_index;
+					}
+				}
+			}
+		}
+		else
+		{
+			stack[stack_size].node_index = node.index + 1;
+			stack[stack_size].active_mask = node_mask;
+			stack_size++;
+			stack[stack_size].node_index = node.index + 0;
+			stack[stack_size].active_mask = node_mask;
+			stack_size++;
+		}
+	}
+}
+
+Intersection finalize_tlas_intersection(Tlas const& tlas, Ray const ray, InstanceHit const hit, uint32_t const* const indices, Vec3 const* const vertices)
+{
+	if (!hit.triangle.valid())
+		return Intersection();
+
+	TriangleRecord const triangle = make_triangle_record(hit.triangle.triangle_index, indices, vertices);
+	Instance const& instance = tlas.instances[hit.instance_index];
+
+	// Normals go through the inverse transpose; the tangent is made perpendicular again in case of non-uniform scale.
+	Vec3 const normal = normalize(inv_ortho_transform_vector(instance.world_to_object.linear, triangle.n));
+	Vec3 const dpdu = transform_vector(instance.object_to_world, triangle.ab);
+
+	Barycentrics bary;
+	bary.u = 1.f - hit.triangle.v - hit.triangle.w;
+	bary.v = hit.triangle.v;
+	bary.w = hit.triangle.w;
+	return Intersection(ray, hit.triangle.t, hit.triangle.triangle_index, normal, dpdu - normal * dot(normal, dpdu), bary);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include "a_bvh.h"
+#include "a_geom.h"
+#include "a_math.h"
+
+// Triangles of one mesh in the shared index and vertex arrays, with a bottom-level BVH in the mesh's own space.
+struct Blas
+{
+	uint32_t triangle_index; // first triangle in the shared arrays
+	uint32_t triangle_count;
+	Bvh bvh; // numbers the mesh's triangles from zero
+};
+
+// One placement of a bottom-level BVH in the world.
+struct Instance
+{
+	uint32_t blas_index;
+	Mat34 object_to_world;
+	Mat34 world_to_object;
+};
+
+struct Tlas
+{
+	uint32_t blas_count;
+	uint32_t instance_count;
+
+	Blas const* blases;
+	Instance const* instances;
+	Bvh bvh; // over the world bounds of the instances
+};
+
+struct InstanceHit
+{
+	TriangleHit triangle; // triangle_index is into the shared arrays
+	uint32_t instance_index;
+};
+
+Instance make_instance(uint32_t blas_index, Mat34 const& object_to_world);
+
+// Only this needs to run again when instances move; the bottom-level BVHs are reused as they are.
+Tlas build_tlas(uint32_t blas_count, Blas const* blases, uint32_t instance_count, Instance const* instances);
+
+Ray world_to_object_ray(Instance const& instance, Ray ray);
+
+InstanceHit intersect_tlas(Tlas const& tlas, Ray ray, uint32_t const* indices, Vec3 const* vertices);
+// Closest hits for the world-space rays in active_mask, traced together; instance_indices gets the instance of each hit.
+void intersect_tlas_packet(Tlas const& tlas, RayPacket const& packet, uint32_t active_mask, RayPacketHits& hits, uint32_t* instance_indices,
+	uint32_t const* indices, Vec3 const* vertices);
+bool occluded_tlas(Tlas const& tlas, Ray ray, float t_max, uint32_t const* indices, Vec3 const* vertices);
+Intersection finalize_tlas_intersection(Tlas const& tlas, Ray ray, InstanceHit hit, uint32_t const* indices, Vec3 const* vertices);
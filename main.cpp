@@ -1,49 +1,121 @@
+#include <float.h>
 #include <math.h>
+#include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <random>
 #include <thread>
+#include <vector>
 
 #include "assimp/Importer.hpp"
 #include "assimp/postprocess.h"
 #include "assimp/scene.h"
 
+#include "a_bvh.h"
 #include "a_geom.h"
 #include "a_image.h"
+#include "a_light_tree.h"
 #include "a_material.h"
+#include "a_random.h"
+#include "a_sampler.h"
+#include "a_thread_pool.h"
+#include "a_tlas.h"
 
 struct Light
 {
 	uint32_t triangle_index;
 	uint32_t triangle_count;
+	uint32_t instance_index; // placement of the light's mesh
+};
+
+struct EmissiveTriangle
+{
+	uint32_t light_index;
+	uint32_t triangle_index;
+	float area; // in world space
 };
 
 struct Scene
 {
-	uint32_t triangle_count;
+	uint32_t triangle_count; // unique triangles, stored once however often their mesh is placed
+	uint32_t placed_triangle_count;
+	uint32_t vertex_count;
 	uint32_t light_count;
 
 	uint32_t const* indices;
 	Vec3 const* vertices;
 	Material const* materials;
 	uint8_t const* material_indices;
+	Tlas tlas;
 
 	Light const* lights;
-	float light_area;
+	uint32_t emissive_triangle_count;
+	EmissiveTriangle const* emissive_triangles; // every placed triangle of every light
+	AliasEntry const* emissive_triangle_alias; // picks one by its area times its emitted luminance
+	float emissive_power; // area times emitted luminance, summed over the emissive triangles
+	LightTree light_tree; // optional, over the emissive triangles, replaces the alias table in light sampling
 	Image const* skydome;
 };
 
-Intersection intersect_scene(Ray const ray, Scene const& scene)
+TriangleHit intersect_scene_brute_force(Ray const ray, Scene const& scene)
 {
-	Intersection intersect;
-	for (uint32_t triangle_index = 0; triangle_index < scene.triangle_count; ++triangle_index)
+	Tlas const& tlas = scene.tlas;
+
+	TriangleHit hit;
+	for (uint32_t instance_index = 0; instance_index < tlas.instance_count; ++instance_index)
 	{
-		Intersection const tri_intersect = intersect_ray_triangle(ray, triangle_index, scene.indices, scene.vertices);
-		if (tri_intersect.t < intersect.t)
+		Instance const& instance = tlas.instances[instance_index];
+		Blas const& blas = tlas.blases[instance.blas_index];
+		Ray const object_ray = world_to_object_ray(instance, ray);
+		for (uint32_t triangle_index = blas.triangle_index; triangle_index < blas.triangle_index + blas.triangle_count; ++triangle_index)
 		{
-			intersect = tri_intersect;
+			TriangleHit const tri_hit = intersect_ray_triangle(object_ray, hit.t, triangle_index, scene.indices, scene.vertices);
+			if (tri_hit.valid())
+			{
+				hit = tri_hit;
+			}
 		}
 	}
-	return intersect;
+	return hit;
+}
+
+InstanceHit intersect_scene_closest(Ray const ray, Scene const& scene)
+{
+	return intersect_tlas(scene.tlas, ray, scene.indices, scene.vertices);
+}
+
+Intersection intersect_scene(Ray const ray, Scene const& scene)
+{
+	return finalize_tlas_intersection(scene.tlas, ray, intersect_scene_closest(ray, scene), scene.indices, scene.vertices);
+}
+
+InstanceHit get_packet_instance_hit(RayPacketHits const& hits, uint32_t const* const instance_indices, uint32_t const lane)
+{
+	InstanceHit hit;
+	hit.triangle = get_ray_packet_hit(hits, lane);
+	hit.instance_index = instance_indices[lane];
+	return hit;
+}
+
+void intersect_scene_packet(Ray const* const rays, uint32_t const ray_count, Scene const& scene, Intersection* const intersects)
+{
+	RayPacket const packet = make_ray_packet(rays, ray_count);
+	RayPacketHits hits;
+	clear_ray_packet_hits(hits, FLT_MAX);
+	uint32_t instance_indices[kRayPacketSize] = {};
+	intersect_tlas_packet(scene.tlas, packet, (1u << ray_count) - 1, hits, instance_indices, scene.indices, scene.vertices);
+
+	for (uint32_t lane = 0; lane < ray_count; ++lane)
+	{
+		intersects[lane] = finalize_tlas_intersection(scene.tlas, rays[lane], get_packet_instance_hit(hits, instance_indices, lane), scene.indices, scene.vertices);
+	}
+}
+
+bool occluded_scene(Ray const ray, float const t_max, Scene const& scene)
+{
+	return occluded_tlas(scene.tlas, ray, t_max, scene.indices, scene.vertices);
 }
 
 struct TriangleSample
@@ -52,12 +124,8 @@ struct TriangleSample
 	Vec3 normal;
 };
 
-TriangleSample random_triangle_sample(uint32_t const triangle_index, Scene const& scene, std::mt19937& random_engine)
+TriangleSample uniform_triangle_sample(uint32_t const triangle_index, Instance const& instance, Scene const& scene, float const u1, float const u2)
 {
-	std::uniform_real_distribution<float> distrib(0.f, 1.f); // [0, 1)
-
-	float const u1 = distrib(random_engine);
-	float const u2 = distrib(random_engine);
 	float const su1 = sqrtf(u1);
 
 	Barycentrics bary;
@@ -69,9 +137,9 @@ TriangleSample random_triangle_sample(uint32_t const triangle_index, Scene const
 	uint32_t const* indices = scene.indices;
 	Vec3 const* vertices = scene.vertices;
 
-	Vec3 const a = vertices[indices[base_index + 0]];
-	Vec3 const b = vertices[indices[base_index + 1]];
-	Vec3 const c = vertices[indices[base_index + 2]];
+	Vec3 const a = transform_point(instance.object_to_world, vertices[indices[base_index + 0]]);
+	Vec3 const b = transform_point(instance.object_to_world, vertices[indices[base_index + 1]]);
+	Vec3 const c = transform_point(instance.object_to_world, vertices[indices[base_index + 2]]);
 
 	Vec3 const ab = b - a;
 	Vec3 const ac = c - a;
@@ -96,6 +164,7 @@ SurfaceRadiance scene_light_radiance(Scene const& scene, Vec3 const direction)
 	return surface;
 }
 
+// Of light sampling picking the direction of a ray that left the scene.
 float scene_light_probability_density(Scene const& scene, Vec3 const direction)
 {
 	if (scene.skydome)
@@ -103,37 +172,65 @@ float scene_light_probability_density(Scene const& scene, Vec3 const direction)
 		return skydome_light_probability_density(*scene.skydome, direction);
 	}
 
-	return 1.f / scene.light_area;
+	return 0.f;
 }
 
-LightSample scene_light_sample(Scene const& scene, std::mt19937& random_engine)
+// Of light sampling from a point on a surface facing normal picking a point on an emissive triangle, per unit area. The
+// triangle is sampled uniformly over its area once picked. Without a light tree it's picked with probability
+// area * luminance / emissive_power wherever the point is, so the area cancels.
+float scene_light_probability_density(Scene const& scene, Vec3 const point, Vec3 const normal, uint32_t const emissive_index)
 {
-	if (scene.skydome)
+	EmissiveTriangle const& emissive_triangle = scene.emissive_triangles[emissive_index];
+	if (scene.light_tree.node_count)
 	{
-		std::uniform_real_distribution<float> distrib(0.f, 1.f); // [0, 1)
+		return light_tree_probability(scene.light_tree, emissive_index, point, normal) / emissive_triangle.area;
+	}
 
-		float const u1 = distrib(random_engine);
-		float const u2 = distrib(random_engine);
+	Material const& material = scene.materials[scene.material_indices[emissive_triangle.triangle_index]];
+	return luminance(material.emissive) / scene.emissive_power;
+}
 
+// A point on a light for a point on a surface facing normal; the probability density is zero if no light can reach it.
+LightSample scene_light_sample(Scene const& scene, Vec3 const point, Vec3 const normal, float const u_select, float const u1, float const u2)
+{
+	if (scene.skydome)
+	{
 		return skydome_light_sample(*scene.skydome, u1, u2);
 	}
 
-	std::uniform_int_distribution<uint32_t> light_distrib(0u, scene.light_count - 1); // TODO: sample by area.
-	uint32_t const light_index = light_distrib(random_engine);
-	Light const& light = scene.lights[light_index];
+	uint32_t emissive_index = kInvalidLight;
+	float tree_probability = 0.f;
+	if (scene.light_tree.node_count)
+	{
+		emissive_index = sample_light_tree(scene.light_tree, point, normal, u_select, tree_probability);
+	}
+	else if (scene.emissive_triangle_count)
+	{
+		emissive_index = sample_alias_table(scene.emissive_triangle_alias, scene.emissive_triangle_count, u_select);
+	}
+	if (kInvalidLight == emissive_index)
+	{
+		LightSample light_sample = {};
+		light_sample.triangle_index = kInvalidTriangle;
+		light_sample.probability_density = 0.f;
+		return light_sample;
+	}
+
+	EmissiveTriangle const& emissive_triangle = scene.emissive_triangles[emissive_index];
+	Light const& light = scene.lights[emissive_triangle.light_index];
 
-	std::uniform_int_distribution<uint32_t> triangle_distrib(0u, light.triangle_count - 1); // TODO: sample by area.
-	uint32_t const triangle_index = light.triangle_index + triangle_distrib(random_engine);
+	uint32_t const triangle_index = emissive_triangle.triangle_index;
 	uint8_t const material_index = scene.material_indices[triangle_index];
 
-	TriangleSample const triangle_sample = random_triangle_sample(triangle_index, scene, random_engine);
+	TriangleSample const triangle_sample = uniform_triangle_sample(triangle_index, scene.tlas.instances[light.instance_index], scene, u1, u2);
 
 	LightSample light_sample = {};
 	light_sample.triangle_index = triangle_index;
 	light_sample.radiance = scene.materials[material_index].emissive;
 	light_sample.point = triangle_sample.point;
 	light_sample.normal = triangle_sample.normal;
-	light_sample.probability_density = scene_light_probability_density(scene, Vec3());
+	light_sample.probability_density = scene.light_tree.node_count ? tree_probability / emissive_triangle.area
+		: scene_light_probability_density(scene, point, normal, emissive_index);
 	return light_sample;
 }
 
@@ -143,13 +240,11 @@ struct CameraSample
 	float y;
 };
 
-CameraSample random_camera_sample(int const x, int const y, int const width, int const height, std::mt19937& random_engine)
+CameraSample jittered_camera_sample(int const x, int const y, int const width, int const height, float const u1, float const u2)
 {
-	std::uniform_real_distribution<float> distrib(0.f, 1.f); // [0, 1)
-
 	CameraSample camera_sample = {};
-	camera_sample.x = (static_cast<float>(x) + distrib(random_engine)) / static_cast<float>(width)  * 2.f - 1.f;
-	camera_sample.y = (static_cast<float>(y) + distrib(random_engine)) / static_cast<float>(height) * 2.f - 1.f;
+	camera_sample.x = (static_cast<float>(x) + u1) / static_cast<float>(width)  * 2.f - 1.f;
+	camera_sample.y = (static_cast<float>(y) + u2) / static_cast<float>(height) * 2.f - 1.f;
 	camera_sample.y *= -1.f;
 	return camera_sample;
 }
@@ -162,37 +257,39 @@ float power_heuristic(float const probability_density_f, float const probability
 	return (f*f) / (f*f + g*g);
 }
 
-BsdfSample surface_bsdf_sample(Vec3 const outgoing, Material const& material, Vec3 const normal, Vec3 const tangent, std::mt19937& random_engine)
+// A direction from the lambert lobe, with the reflectance and density of both lobes for it.
+BsdfSample surface_bsdf_lambert_sample(Vec3 const outgoing, Material const& material, Vec3 const normal, Vec3 const tangent, float const u1, float const u2)
 {
-	std::uniform_real_distribution<float> sample_distrib(0.f, 1.f); // [0, 1)
-
-	float const u1 = sample_distrib(random_engine);
-	float const u2 = sample_distrib(random_engine);
-
-	std::uniform_int_distribution<> bsdf_distrib(0, 1);
-
 	BsdfSample const lambert_sample = lambert_brdf_sample(outgoing, material, normal, tangent, u1, u2);
-	BsdfSample const ggx_smith_sample = ggx_smith_brdf_sample(outgoing, material, normal, tangent, u1, u2);
 
 	BsdfSample bsdf_sample;
+	bsdf_sample.direction = lambert_sample.direction;
+	bsdf_sample.reflectance = lambert_sample.reflectance + ggx_smith_brdf_reflectance(material, normal, lambert_sample.direction, outgoing);
+	bsdf_sample.probability_density = 0.5f * (lambert_sample.probability_density + ggx_smith_brdf_probability_density(material, normal, lambert_sample.direction, outgoing));
+	return bsdf_sample;
+}
 
-	switch (bsdf_distrib(random_engine))
-	{
-	case 0:
-		bsdf_sample.direction = lambert_sample.direction;
-		bsdf_sample.reflectance = lambert_sample.reflectance + ggx_smith_brdf_reflectance(material, normal, lambert_sample.direction, outgoing);
-		bsdf_sample.probability_density = 0.5f * (lambert_sample.probability_density + ggx_smith_brdf_probability_density(material, normal, lambert_sample.direction, outgoing));
-		break;
-	case 1:
-		bsdf_sample.direction = ggx_smith_sample.direction;
-		bsdf_sample.reflectance = lambert_brdf_reflectance(material, normal, ggx_smith_sample.direction, outgoing) + ggx_smith_sample.reflectance;
-		bsdf_sample.probability_density = 0.5f * (lambert_brdf_probability_density(normal, ggx_smith_sample.direction, outgoing) + ggx_smith_sample.probability_density);
-		break;
-	}
+// A direction from the GGX lobe, with the reflectance and density of both lobes for it.
+BsdfSample surface_bsdf_ggx_smith_sample(Vec3 const outgoing, Material const& material, Vec3 const normal, Vec3 const tangent, float const u1, float const u2)
+{
+	BsdfSample const ggx_smith_sample = ggx_smith_brdf_sample(outgoing, material, normal, tangent, u1, u2);
 
+	BsdfSample bsdf_sample;
+	bsdf_sample.direction = ggx_smith_sample.direction;
+	bsdf_sample.reflectance = lambert_brdf_reflectance(material, normal, ggx_smith_sample.direction, outgoing) + ggx_smith_sample.reflectance;
+	bsdf_sample.probability_density = 0.5f * (lambert_brdf_probability_density(normal, ggx_smith_sample.direction, outgoing) + ggx_smith_sample.probability_density);
 	return bsdf_sample;
 }
 
+// Only the lobe u_lobe picks is sampled; the other is just evaluated for the sampled direction.
+BsdfSample surface_bsdf_sample(Vec3 const outgoing, Material const& material, Vec3 const normal, Vec3 const tangent, float const u_lobe,
+	float const u1, float const u2)
+{
+	if (u_lobe < 0.5f)
+		return surface_bsdf_lambert_sample(outgoing, material, normal, tangent, u1, u2);
+	return surface_bsdf_ggx_smith_sample(outgoing, material, normal, tangent, u1, u2);
+}
+
 RGB surface_bsdf_reflectance(Material const& material, Vec3 const normal, Vec3 const incoming, Vec3 const outgoing)
 {
 	return lambert_brdf_reflectance(material, normal, incoming, outgoing) + ggx_smith_brdf_reflectance(material, normal, incoming, outgoing);
@@ -203,20 +300,100 @@ float surface_brdf_probability_density(Material const& material, Vec3 const norm
 	return 0.5f * (lambert_brdf_probability_density(normal, incoming, outgoing) + ggx_smith_brdf_probability_density(material, normal, incoming, outgoing));
 }
 
-bool sample_russian_roulette(float const continue_probability, std::mt19937& random_engine)
+bool sample_russian_roulette(float const continue_probability, float const u)
 {
-	std::uniform_real_distribution<float> distrib(0.f, 1.f); // [0, 1)
-	return distrib(random_engine) > continue_probability;
+	return u > continue_probability;
 }
 
-RGB sample_image(Vec3 const camera_position, Vec3 const camera_direction, Scene const& scene, std::mt19937& random_engine)
+// Light the path found by itself, weighted against having been picked by light sampling at the previous vertex.
+RGB implicit_path_sample(Scene const& scene, Ray const ray, SurfaceRadiance const& surface, int const path_length, RGB const path_throughput,
+	float const last_forward_sampling_probability_density)
+{
+	RGB const implicit_path_sample = path_throughput * surface.radiance;
+	float implicit_path_weight = 1.f;
+	if (path_length > 1)
+	{
+		float const geometric_factor = dot(-ray.direction, surface.normal) / length_sqr(surface.point - ray.origin);
+		float const implicit_path_probability_density = last_forward_sampling_probability_density * geometric_factor;
+		float const explicit_path_probability_density = scene_light_probability_density(scene, ray.direction);
+		implicit_path_weight = power_heuristic(implicit_path_probability_density, explicit_path_probability_density);
+	}
+	return implicit_path_weight * implicit_path_sample;
+}
+
+// The numbers one path vertex uses, drawn in the same order at every vertex so each decision keeps its dimensions.
+struct PathVertexSamples
+{
+	float light_select;
+	float light[2];
+	float bsdf_lobe;
+	float bsdf[2];
+	float roulette;
+};
+
+PathVertexSamples draw_path_vertex_samples(PathSampler& sampler)
+{
+	PathVertexSamples samples;
+	float unused;
+	sample_2d(sampler, samples.light[0], samples.light[1]);
+	sample_2d(sampler, samples.bsdf[0], samples.bsdf[1]);
+	sample_2d(sampler, samples.light_select, samples.bsdf_lobe);
+	sample_2d(sampler, samples.roulette, unused);
+	return samples;
+}
+
+// A light sample's contribution, which only counts if nothing blocks the ray up to t_max.
+struct ShadowRay
+{
+	Ray ray;
+	float t_max;
+	RGB contribution;
+};
+
+bool explicit_path_sample(Scene const& scene, Ray const ray, Intersection const& intersect, Material const& material, Vec3 const biased_point,
+	RGB const path_throughput, PathVertexSamples const& samples, ShadowRay& shadow_ray)
+{
+	LightSample const light_sample = scene_light_sample(scene, biased_point, intersect.normal, samples.light_select, samples.light[0], samples.light[1]);
+	if (light_sample.probability_density == 0.f)
+		return false;
+
+	Ray const light_ray(biased_point, light_sample.point - biased_point);
+	float const cosine_factor = dot(light_ray.direction, intersect.normal);
+	if (cosine_factor <= 0.f)
+		return false;
+
+	float const light_cosine_factor = dot(-light_ray.direction, light_sample.normal);
+	if (light_cosine_factor <= 0.f)
+		return false;
+
+	RGB const reflectance = surface_bsdf_reflectance(material, intersect.normal, light_ray.direction, -ray.direction);
+	float const forward_sampling_probability_density = surface_brdf_probability_density(material, intersect.normal, light_ray.direction, -ray.direction);
+
+	RGB const extended_path_throughput = path_throughput * reflectance * cosine_factor;
+	float const geometric_factor = light_cosine_factor / length_sqr(light_sample.point - biased_point);
+	RGB const explicit_path_sample = extended_path_throughput * light_sample.radiance * (geometric_factor / light_sample.probability_density);
+	float const implicit_path_probability_density = forward_sampling_probability_density * geometric_factor;
+
+	// Only the skydome is found implicitly, so lights with geometry keep all of their weight here.
+	bool const found_implicitly = (kInvalidTriangle == light_sample.triangle_index);
+	float const explicit_path_weight = found_implicitly ? power_heuristic(light_sample.probability_density, implicit_path_probability_density) : 1.f;
+
+	// Lights with geometry are tested up to just short of their surface, the skydome is infinitely far away.
+	shadow_ray.ray = light_ray;
+	shadow_ray.t_max = (kInvalidTriangle != light_sample.triangle_index) ? length(light_sample.point - biased_point) - 1e-3f : FLT_MAX;
+	shadow_ray.contribution = explicit_path_weight * explicit_path_sample;
+	return true;
+}
+
+// Follow a path from the camera whose first intersection was already found, possibly along with other camera rays.
+RGB sample_image(Ray const camera_ray, Intersection const& camera_intersect, Scene const& scene, PathSampler& sampler)
 {
 	RGB color;
 
 	float const continue_probability = 0.8f;
 
 	int path_length = 0;
-	Ray ray(camera_position, camera_direction);
+	Ray ray = camera_ray;
 	RGB path_throughput(1.f, 1.f, 1.f);
 	float last_forward_sampling_probability_density = 0.f;
 
@@ -224,7 +401,7 @@ RGB sample_image(Vec3 const camera_position, Vec3 const camera_direction, Scene
 	{
 		++path_length;
 
-		Intersection const intersect = intersect_scene(ray, scene);
+		Intersection const intersect = (1 == path_length) ? camera_intersect : intersect_scene(ray, scene);
 
 		// Implicit path.
 		//
@@ -251,16 +428,7 @@ RGB sample_image(Vec3 const camera_position, Vec3 const camera_direction, Scene
 
 			if (surface.is_light)
 			{
-				RGB const implicit_path_sample = path_throughput * surface.radiance;
-				float implicit_path_weight = 1.f;
-				if (path_length > 1)
-				{
-					float const geometric_factor = dot(-ray.direction, surface.normal) / length_sqr(surface.point - ray.origin);
-					float const implicit_path_probability_density = last_forward_sampling_probability_density * geometric_factor;
-					float const explicit_path_probability_density = scene_light_probability_density(scene, ray.direction);
-					implicit_path_weight = power_heuristic(implicit_path_probability_density, explicit_path_probability_density);
-				}
-				color += implicit_path_weight * implicit_path_sample;
+				color += implicit_path_sample(scene, ray, surface, path_length, path_throughput, last_forward_sampling_probability_density);
 			}
 		}
 
@@ -269,33 +437,18 @@ RGB sample_image(Vec3 const camera_position, Vec3 const camera_direction, Scene
 
 		Material const& material = scene.materials[scene.material_indices[intersect.triangle_index]];
 		Vec3 const biased_point = intersect.point + intersect.normal * 1e-3f; // Avoid acne from self-shadowing.
+		PathVertexSamples const samples = draw_path_vertex_samples(sampler);
 
 		// Explicit path.
 		//
 
 		{
-			LightSample const light_sample = scene_light_sample(scene, random_engine); // TODO: importance sampling.
-			Ray const light_ray(biased_point, light_sample.point - biased_point);
-			float const cosine_factor = dot(light_ray.direction, intersect.normal);
-			if (cosine_factor > 0.f)
+			ShadowRay shadow_ray;
+			if (explicit_path_sample(scene, ray, intersect, material, biased_point, path_throughput, samples, shadow_ray))
 			{
-				Intersection const light_intersect = intersect_scene(light_ray, scene); // TODO: this should be a line test.
-				if (!light_intersect.valid() || light_intersect.triangle_index == light_sample.triangle_index)
+				if (!occluded_scene(shadow_ray.ray, shadow_ray.t_max, scene))
 				{
-					float const light_cosine_factor = dot(-light_ray.direction, light_sample.normal);
-					if (light_cosine_factor > 0.f)
-					{
-						RGB const reflectance = surface_bsdf_reflectance(material, intersect.normal, light_ray.direction, -ray.direction);
-						float const forward_sampling_probability_density = surface_brdf_probability_density(material, intersect.normal, light_ray.direction, -ray.direction);
-
-						RGB const extended_path_throughput = path_throughput * reflectance * cosine_factor;
-						float const geometric_factor = light_cosine_factor / length_sqr(light_sample.point - biased_point);
-						RGB const explicit_path_sample = extended_path_throughput * light_sample.radiance * (geometric_factor / light_sample.probability_density);
-						float const implicit_path_probability_density = forward_sampling_probability_density * geometric_factor;
-
-						float const explicit_path_weight = power_heuristic(light_sample.probability_density, implicit_path_probability_density);
-						color += explicit_path_weight * explicit_path_sample;
-					}
+					color += shadow_ray.contribution;
 				}
 			}
 		}
@@ -305,7 +458,7 @@ RGB sample_image(Vec3 const camera_position, Vec3 const camera_direction, Scene
 
 		if (path_length > 3)
 		{
-			if (sample_russian_roulette(continue_probability, random_engine))
+			if (sample_russian_roulette(continue_probability, samples.roulette))
 				break;
 			path_throughput /= continue_probability;
 		}
@@ -313,7 +466,7 @@ RGB sample_image(Vec3 const camera_position, Vec3 const camera_direction, Scene
 		// Extend the path.
 		//
 
-		BsdfSample const bsdf_sample = surface_bsdf_sample(-ray.direction, material, intersect.normal, intersect.tangent, random_engine);
+		BsdfSample const bsdf_sample = surface_bsdf_sample(-ray.direction, material, intersect.normal, intersect.tangent, samples.bsdf_lobe, samples.bsdf[0], samples.bsdf[1]);
 		if (bsdf_sample.probability_density == 0.f)
 			break;
 		ray = Ray(biased_point, bsdf_sample.direction);
@@ -324,119 +477,1334 @@ RGB sample_image(Vec3 const camera_position, Vec3 const camera_direction, Scene
 	return color;
 }
 
+struct MeshPlacement
+{
+	uint32_t mesh_index;
+	Mat34 object_to_world;
+};
+
+void gather_mesh_placements(aiNode const* const node, Mat34 const& parent_to_world, std::vector<MeshPlacement>& placements)
+{
+	aiMatrix4x4 const& m = node->mTransformation;
+	Mat34 const node_to_parent(Mat33(Vec3(m.a1, m.b1, m.c1), Vec3(m.a2, m.b2, m.c2), Vec3(m.a3, m.b3, m.c3)), Vec3(m.a4, m.b4, m.c4));
+	Mat34 const node_to_world = parent_to_world * node_to_parent;
+
+	for (uint32_t i = 0; i < node->mNumMeshes; ++i)
+	{
+		MeshPlacement placement;
+		placement.mesh_index = node->mMeshes[i];
+		placement.object_to_world = node_to_world;
+		placements.push_back(placement);
+	}
+	for (uint32_t i = 0; i < node->mNumChildren; ++i)
+	{
+		gather_mesh_placements(node->mChildren[i], node_to_world, placements);
+	}
+}
+
 struct SceneSizes
 {
 	uint32_t triangle_count;
+	uint32_t placed_triangle_count;
 	uint32_t vertex_count;
 	uint32_t light_count;
+	uint32_t blas_count;
+	uint32_t instance_count;
 };
 
-SceneSizes get_scene_sizes(aiScene const* const scene)
+// Meshes placed once are baked into world space and share one bottom-level BVH unless bake is off; the others get one
+// each.
+SceneSizes get_scene_sizes(aiScene const* const scene, uint32_t const* const placement_counts, bool const bake)
 {
 	uint32_t const mesh_count = scene->mNumMeshes;
 
 	SceneSizes sizes = {};
+	bool has_baked_meshes = false;
 	for (uint32_t mesh_index = 0; mesh_index < mesh_count; ++mesh_index)
 	{
 		aiMesh const* const mesh = scene->mMeshes[mesh_index];
 		aiMaterial const* const material = scene->mMaterials[mesh->mMaterialIndex];
-		if (aiPrimitiveType_TRIANGLE == mesh->mPrimitiveTypes)
+		uint32_t const placement_count = placement_counts[mesh_index];
+		if (aiPrimitiveType_TRIANGLE == mesh->mPrimitiveTypes && placement_count)
 		{
 			sizes.triangle_count += mesh->mNumFaces;
+			sizes.placed_triangle_count += placement_count * mesh->mNumFaces;
 			sizes.vertex_count += mesh->mNumVertices;
 
+			if (bake && 1 == placement_count)
+			{
+				has_baked_meshes = true;
+			}
+			else
+			{
+				sizes.blas_count++;
+				sizes.instance_count += placement_count;
+			}
+
 			aiColor3D emissive;
 			if (AI_SUCCESS == material->Get(AI_MATKEY_COLOR_EMISSIVE, emissive))
 				if (!emissive.IsBlack())
-					sizes.light_count++;
+					sizes.light_count += placement_count;
 		}
 	}
+	if (has_baked_meshes)
+	{
+		sizes.blas_count++;
+		sizes.instance_count++;
+	}
 	return sizes;
 }
 
-float get_scene_light_area(Scene const& scene)
+// Light sampling weighs triangles in world space, so the table is rebuilt whenever the vertices or instances move. The
+// same triangles stay emissive across frames, so a light tree from an earlier frame is refit rather than rebuilt.
+void build_emissive_triangle_table(Scene& scene, bool const light_tree)
 {
 	uint32_t const* indices = scene.indices;
 	Vec3 const* vertices = scene.vertices;
 
-	float light_area = 0.f;
+	delete[] scene.emissive_triangles;
+	delete[] scene.emissive_triangle_alias;
+
+	uint32_t emissive_triangle_count = 0;
+	for (uint32_t light_index = 0; light_index < scene.light_count; ++light_index)
+	{
+		emissive_triangle_count += scene.lights[light_index].triangle_count;
+	}
+
+	EmissiveTriangle* const emissive_triangles = new EmissiveTriangle[emissive_triangle_count];
+	AliasEntry* const emissive_triangle_alias = new AliasEntry[emissive_triangle_count];
+	std::vector<float> weights(emissive_triangle_count);
+	std::vector<LightBounds> light_bounds(light_tree ? emissive_triangle_count : 0);
 
+	double emissive_power = 0.0;
+	uint32_t emissive_index = 0;
 	for (uint32_t light_index = 0; light_index < scene.light_count; ++light_index)
 	{
 		Light const& light = scene.lights[light_index];
-		for (uint32_t triangle_index = 0; triangle_index < light.triangle_count; ++triangle_index)
+		Mat34 const& object_to_world = scene.tlas.instances[light.instance_index].object_to_world;
+		for (uint32_t triangle_index = light.triangle_index; triangle_index < light.triangle_index + light.triangle_count; ++triangle_index)
 		{
-			uint32_t const base_index = 3u * (light.triangle_index + triangle_index);
+			uint32_t const base_index = 3u * triangle_index;
 
-			Vec3 const a = vertices[indices[base_index + 0]];
-			Vec3 const b = vertices[indices[base_index + 1]];
-			Vec3 const c = vertices[indices[base_index + 2]];
+			Vec3 const a = transform_point(object_to_world, vertices[indices[base_index + 0]]);
+			Vec3 const b = transform_point(object_to_world, vertices[indices[base_index + 1]]);
+			Vec3 const c = transform_point(object_to_world, vertices[indices[base_index + 2]]);
 
 			Vec3 const ab = b - a;
 			Vec3 const ac = c - a;
 
 			Vec3 const n = cross(ab, ac);
-			light_area += 0.5f * length(n);
+			float const area = 0.5f * length(n);
+			Material const& material = scene.materials[scene.material_indices[triangle_index]];
+
+			emissive_triangles[emissive_index].light_index = light_index;
+			emissive_triangles[emissive_index].triangle_index = triangle_index;
+			emissive_triangles[emissive_index].area = area;
+			weights[emissive_index] = area * luminance(material.emissive);
+			emissive_power += weights[emissive_index];
+
+			// One-sided, lighting the half space around its normal.
+			if (light_tree)
+			{
+				LightBounds& bounds = light_bounds[emissive_index];
+				bounds.bounds = aabb_union(aabb_union(Aabb(a, a), b), c);
+				bounds.axis = (area > 0.f) ? normalize(n) : Vec3(0.f, 0.f, 1.f);
+				bounds.cos_theta_o = 1.f;
+				bounds.cos_theta_e = 0.f;
+				bounds.power = weights[emissive_index];
+			}
+			emissive_index++;
+		}
+	}
+	build_alias_table(weights.data(), emissive_triangle_count, emissive_triangle_alias);
+	if (light_tree && scene.light_tree.node_count)
+		refit_light_tree(scene.light_tree, light_bounds.data());
+	else if (light_tree)
+		scene.light_tree = build_light_tree(emissive_triangle_count, light_bounds.data());
+
+	scene.emissive_triangle_count = emissive_triangle_count;
+	scene.emissive_triangles = emissive_triangles;
+	scene.emissive_triangle_alias = emissive_triangle_alias;
+	scene.emissive_power = static_cast<float>(emissive_power);
+}
+
+Vec3 const kCameraPosition(0.f, 1.f, 4.9f);
+float const kImagePlaneSize = 0.25f;
+int const kImageWidth = 256;
+int const kImageHeight = 256;
+
+double seconds_since(std::chrono::steady_clock::time_point const start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Totals over the bottom-level BVHs; the SAH cost is weighted by each one's share of the triangles.
+void print_bvh_report(Scene const& scene, double const build_seconds, uint32_t const build_thread_count)
+{
+	Tlas const& tlas = scene.tlas;
+	if (!tlas.blas_count)
+		return;
+
+	Bvh const& first_bvh = tlas.blases[0].bvh;
+	uint32_t primitive_count = 0, node_count = 0, depth = 0, block_count = 0, wide_node_count = 0, quantized_node_count = 0;
+	float sah_cost = 0.f;
+	for (uint32_t blas_index = 0; blas_index < tlas.blas_count; ++blas_index)
+	{
+		Blas const& blas = tlas.blases[blas_index];
+		Bvh const& bvh = blas.bvh;
+		primitive_count += bvh.primitive_count;
+		node_count += bvh.node_count;
+		depth = std::max(depth, bvh_depth(bvh));
+		block_count += bvh.block_count;
+		wide_node_count += bvh.wide_node_count;
+		quantized_node_count += bvh.quantized_node_count;
+		sah_cost += bvh_sah_cost(bvh) * blas.triangle_count / scene.triangle_count;
+	}
+
+	size_t const bvh_bytes = node_count * sizeof(BvhNode) + primitive_count * sizeof(uint32_t);
+	size_t const record_bytes = (first_bvh.triangle_records) ? primitive_count * sizeof(TriangleRecord) : 0;
+	size_t const block_bytes = (first_bvh.triangle_blocks) ? block_count * sizeof(TriangleBlock) + node_count * sizeof(uint32_t) : 0;
+	printf("BVH: %u triangles, %u references, %u nodes, depth %u, SAH cost %.2f, %.2f MB + %.2f MB triangle records + %.2f MB %u-wide triangle blocks, built in %.3f s on %u threads (%.2f MTris/s)\n",
+		scene.triangle_count, primitive_count, node_count, depth, sah_cost, bvh_bytes / (1024.0 * 1024.0), record_bytes / (1024.0 * 1024.0),
+		block_bytes / (1024.0 * 1024.0), (first_bvh.triangle_blocks) ? first_bvh.simd_width : 1u, build_seconds, build_thread_count, scene.triangle_count / (build_seconds * 1e6));
+	if (first_bvh.wide_nodes)
+	{
+		printf("Wide BVH: %u-wide, %u nodes, %.2f MB, %u-wide node tests\n",
+			first_bvh.wide_width, wide_node_count, wide_node_count * sizeof(WideBvhNode) / (1024.0 * 1024.0), first_bvh.wide_simd_width);
+	}
+	if (first_bvh.quantized_nodes)
+	{
+		printf("Quantized BVH: %u-wide, %u nodes, %.2f MB\n",
+			kQuantizedBvhWidth, quantized_node_count, quantized_node_count * sizeof(QuantizedBvhNode) / (1024.0 * 1024.0));
+	}
+}
+
+void print_instancing_report(Scene const& scene, double const tlas_build_seconds)
+{
+	Tlas const& tlas = scene.tlas;
+	printf("Instancing: %u bottom-level BVHs, %u instances, %u unique triangles for %u placed, top-level BVH of %u nodes built in %.3f ms\n",
+		tlas.blas_count, tlas.instance_count, scene.triangle_count, scene.placed_triangle_count, tlas.bvh.node_count, tlas_build_seconds * 1e3);
+}
+
+Ray primary_ray(int const pixel_index)
+{
+	float const x = ((pixel_index % kImageWidth) + 0.5f) / static_cast<float>(kImageWidth) * 2.f - 1.f;
+	float const y = ((pixel_index / kImageWidth) + 0.5f) / static_cast<float>(kImageHeight) * -2.f + 1.f;
+	return Ray(kCameraPosition, Vec3(x * kImagePlaneSize, y * kImagePlaneSize, -1.f));
+}
+
+double trace_primary_rays(Scene const& scene)
+{
+	int const ray_count = kImageWidth * kImageHeight;
+	auto const start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ray_count; ++i)
+	{
+		intersect_scene_closest(primary_ray(i), scene);
+	}
+	return ray_count / seconds_since(start);
+}
+
+// Point every bottom-level BVH of a copied scene at the node layouts being measured.
+void select_node_layouts(Scene const& scene, std::vector<Blas>& layout_blases, bool const wide_nodes, bool const quantized_nodes)
+{
+	for (uint32_t blas_index = 0; blas_index < scene.tlas.blas_count; ++blas_index)
+	{
+		Bvh const& bvh = scene.tlas.blases[blas_index].bvh;
+		layout_blases[blas_index].bvh.wide_nodes = (wide_nodes) ? bvh.wide_nodes : nullptr;
+		layout_blases[blas_index].bvh.quantized_nodes = (quantized_nodes) ? bvh.quantized_nodes : nullptr;
+	}
+}
+
+// Trace the same rays through each node layout that was built, so their footprints can be weighed against their speed.
+void print_node_layout_report(Scene const& scene)
+{
+	Tlas const& tlas = scene.tlas;
+	if (!tlas.blas_count)
+		return;
+
+	Bvh const& first_bvh = tlas.blases[0].bvh;
+	if (!first_bvh.wide_nodes && !first_bvh.quantized_nodes)
+		return;
+
+	uint32_t node_count = 0, wide_node_count = 0, quantized_node_count = 0;
+	for (uint32_t blas_index = 0; blas_index < tlas.blas_count; ++blas_index)
+	{
+		Bvh const& bvh = tlas.blases[blas_index].bvh;
+		node_count += bvh.node_count;
+		wide_node_count += bvh.wide_node_count;
+		quantized_node_count += bvh.quantized_node_count;
+	}
+
+	std::vector<Blas> layout_blases(tlas.blases, tlas.blases + tlas.blas_count);
+	Scene layout_scene = scene;
+	layout_scene.tlas.blases = layout_blases.data();
+
+	select_node_layouts(scene, layout_blases, false, false);
+	printf("Node layouts: binary %.2f MB %.2f Mrays/s", node_count * sizeof(BvhNode) / (1024.0 * 1024.0), trace_primary_rays(layout_scene) * 1e-6);
+
+	if (first_bvh.wide_nodes)
+	{
+		select_node_layouts(scene, layout_blases, true, false);
+		printf(", %u-wide %.2f MB %.2f Mrays/s", first_bvh.wide_width, wide_node_count * sizeof(WideBvhNode) / (1024.0 * 1024.0), trace_primary_rays(layout_scene) * 1e-6);
+	}
+	if (first_bvh.quantized_nodes)
+	{
+		select_node_layouts(scene, layout_blases, true, true);
+		printf(", quantized %u-wide %.2f MB %.2f Mrays/s", kQuantizedBvhWidth, quantized_node_count * sizeof(QuantizedBvhNode) / (1024.0 * 1024.0), trace_primary_rays(layout_scene) * 1e-6);
+	}
+	printf("\n");
+}
+
+void trace_primary_ray_packet(int const first_ray, Scene const& scene, Ray* const rays, RayPacketHits& hits)
+{
+	for (uint32_t lane = 0; lane < kRayPacketSize; ++lane)
+	{
+		rays[lane] = primary_ray(first_ray + lane);
+	}
+
+	uint32_t instance_indices[kRayPacketSize] = {};
+	clear_ray_packet_hits(hits, FLT_MAX);
+	intersect_tlas_packet(scene.tlas, make_ray_packet(rays, kRayPacketSize), (1u << kRayPacketSize) - 1, hits, instance_indices, scene.indices, scene.vertices);
+}
+
+// Trace the pixel centers as packets of neighbours along a row, against the same rays one at a time.
+void print_packet_report(Scene const& scene)
+{
+	int const ray_count = kImageWidth * kImageHeight;
+	Ray rays[kRayPacketSize];
+	RayPacketHits hits;
+
+	auto const packet_start = std::chrono::steady_clock::now();
+	for (int first_ray = 0; first_ray < ray_count; first_ray += kRayPacketSize)
+	{
+		trace_primary_ray_packet(first_ray, scene, rays, hits);
+	}
+	double const packet_rate = ray_count / seconds_since(packet_start);
+
+	uint32_t mismatch_count = 0;
+	for (int first_ray = 0; first_ray < ray_count; first_ray += kRayPacketSize)
+	{
+		trace_primary_ray_packet(first_ray, scene, rays, hits);
+		for (uint32_t lane = 0; lane < kRayPacketSize; ++lane)
+		{
+			float const t = intersect_scene_closest(rays[lane], scene).triangle.t;
+			mismatch_count += fabsf(hits.t[lane] - t) > 1e-5f * t;
 		}
 	}
 
-	return light_area;
+	printf("Primary rays: single %.2f Mrays/s, %u-ray packets %.2f Mrays/s, %u mismatches\n",
+		trace_primary_rays(scene) * 1e-6, kRayPacketSize, packet_rate * 1e-6, mismatch_count);
 }
 
-void path_trace(Scene const& scene, Image& image)
+// Floats drawn per second the way the sampling helpers used to (an mt19937 engine and a distribution object per
+// call), with one Philox hash per number, and from the PCG32 streams the helpers use now.
+void print_random_report()
 {
-	std::mt19937 random_engine;
-	Vec3 const camera_position(0.f, 1.f, 4.9f);
-	float const image_plane_size = 0.25f;
+	uint32_t const draw_count = 1u << 24;
+	uint32_t const stream_count = 1u << 20;
+	double sum = 0.0; // printed, so none of the loops can be dropped
 
-	int const width = 256;
-	int const height = 256;
-	int const samples_per_pixel = 16;
+	std::mt19937 engine;
+	auto const mt_start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < draw_count; ++i)
+	{
+		std::uniform_real_distribution<float> distrib(0.f, 1.f); // [0, 1)
+		sum += distrib(engine);
+	}
+	double const mt_rate = draw_count / seconds_since(mt_start);
+
+	auto const philox_start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < draw_count; ++i)
+	{
+		sum += static_cast<float>(random_bits(0, 0, i) >> 8) * (1.f / 16777216.f);
+	}
+	double const philox_rate = draw_count / seconds_since(philox_start);
+
+	RandomStream stream = make_random_stream(0, 0);
+	auto const pcg_start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < draw_count; ++i)
+	{
+		sum += random_float(stream);
+	}
+	double const pcg_rate = draw_count / seconds_since(pcg_start);
+
+	// Every path sample starts its own stream.
+	auto const setup_start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < stream_count; ++i)
+	{
+		RandomStream sample_stream = make_random_stream(i, 0);
+		sum += random_float(sample_stream);
+	}
+	double const setup_rate = stream_count / seconds_since(setup_start);
+
+	printf("Random floats: mt19937 %.1f M/s, Philox %.1f M/s, PCG32 %.1f M/s; %.1f M PCG32 streams started/s (checksum %.0f)\n",
+		mt_rate * 1e-6, philox_rate * 1e-6, pcg_rate * 1e-6, setup_rate * 1e-6, sum);
+}
+
+// Directions mapped to skydome texture coordinates per second by atan2f and acosf and by the polynomials that replace
+// them, and how far apart the two land, in texels of this skydome.
+void print_skydome_mapping_report(Image const& skydome)
+{
+	uint32_t const direction_count = 1u << 22;
+	std::vector<Vec3> directions(direction_count);
+	RandomStream stream = make_random_stream(0, 0);
+	for (Vec3& direction : directions)
+	{
+		float const z = 1.f - 2.f * random_float(stream);
+		float const r = sqrtf(std::max(0.f, 1.f - z * z));
+		float const phi = 6.28318530717958647692f * random_float(stream);
+		direction = Vec3(r * cosf(phi), z, r * sinf(phi));
+	}
+	double sum = 0.0; // printed, so neither loop can be dropped
+
+	auto const exact_start = std::chrono::steady_clock::now();
+	for (Vec3 const direction : directions)
+	{
+		float u, v;
+		skydome_direction_to_uv_exact(direction, u, v);
+		sum += u + v;
+	}
+	double const exact_rate = direction_count / seconds_since(exact_start);
+
+	auto const fast_start = std::chrono::steady_clock::now();
+	for (Vec3 const direction : directions)
+	{
+		float u, v;
+		skydome_direction_to_uv(direction, u, v);
+		sum += u + v;
+	}
+	double const fast_rate = direction_count / seconds_since(fast_start);
+
+	float const width = static_cast<float>(skydome.width);
+	float const height = static_cast<float>(skydome.height);
+	double max_error = 0.0;
+	double total_error = 0.0;
+	uint32_t texel_mismatch_count = 0;
+	for (Vec3 const direction : directions)
+	{
+		float exact_u, exact_v, u, v;
+		skydome_direction_to_uv_exact(direction, exact_u, exact_v);
+		skydome_direction_to_uv(direction, u, v);
+
+		// u wraps around, so the two may be a whole turn apart.
+		float const du = u - exact_u;
+		double const error_u = fabsf(du - floorf(du + .5f)) * width;
+		double const error_v = fabsf(v - exact_v) * height;
+		double const error = std::max(error_u, error_v);
+		max_error = std::max(max_error, error);
+		total_error += error;
+
+		int const exact_x = static_cast<int>((exact_u - floorf(exact_u)) * width + .5f) % skydome.width;
+		int const x = static_cast<int>((u - floorf(u)) * width + .5f) % skydome.width;
+		int const exact_y = std::min(static_cast<int>(exact_v * height + .5f), skydome.height - 1);
+		int const y = std::min(static_cast<int>(v * height + .5f), skydome.height - 1);
+		texel_mismatch_count += (x != exact_x) || (y != exact_y);
+	}
+
+	printf("Skydome mapping: atan2f/acosf %.1f M/s, polynomial %.1f M/s; error max %.2e mean %.2e texels, %.4f%% nearest texels differ (checksum %.0f)\n",
+		exact_rate * 1e-6, fast_rate * 1e-6, max_error, total_error / direction_count, 100.0 * texel_mismatch_count / direction_count, sum);
+}
+
+void print_traversal_report(Scene const& scene)
+{
+	// One ray through the center of every pixel; the brute-force loop only gets a strided subset on big scenes.
+	int const ray_count = kImageWidth * kImageHeight;
+	uint64_t const max_brute_force_tests = 1ull << 26;
+	uint64_t const brute_force_tests = static_cast<uint64_t>(ray_count) * scene.placed_triangle_count;
+	int const brute_force_stride = static_cast<int>(std::min<uint64_t>(ray_count, brute_force_tests / max_brute_force_tests + 1));
+
+	uint32_t hit_count = 0;
+	auto const bvh_start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ray_count; ++i)
+	{
+		hit_count += intersect_scene_closest(primary_ray(i), scene).triangle.valid();
+	}
+	double const bvh_seconds = seconds_since(bvh_start);
+
+	uint32_t brute_force_hit_count = 0;
+	int brute_force_ray_count = 0;
+	auto const brute_force_start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ray_count; i += brute_force_stride)
+	{
+		brute_force_hit_count += intersect_scene_brute_force(primary_ray(i), scene).valid();
+		brute_force_ray_count++;
+	}
+	double const brute_force_seconds = seconds_since(brute_force_start);
+
+	uint32_t mismatch_count = 0;
+	for (int i = 0; i < ray_count; i += brute_force_stride)
+	{
+		Ray const ray = primary_ray(i);
+		float const t = intersect_scene_closest(ray, scene).triangle.t;
+		float const brute_force_t = intersect_scene_brute_force(ray, scene).t;
+		mismatch_count += fabsf(t - brute_force_t) > 1e-5f * brute_force_t;
+	}
+
+	double const bvh_rate = ray_count / bvh_seconds;
+	double const brute_force_rate = brute_force_ray_count / brute_force_seconds;
+	printf("Traversal: BVH %.2f Mrays/s (%d rays, %u hits), brute force %.4f Mrays/s (%d rays, %u hits), %.1fx speedup, %u mismatches\n",
+		bvh_rate * 1e-6, ray_count, hit_count, brute_force_rate * 1e-6, brute_force_ray_count, brute_force_hit_count, bvh_rate / brute_force_rate, mismatch_count);
+}
+
+int const kTileSize = 32;
+
+// A rectangle of the image rendered as one task; tiles along the right and bottom edges may be smaller.
+struct ImageTile
+{
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+uint32_t get_image_tile_count(int const width, int const height)
+{
+	return static_cast<uint32_t>(((width + kTileSize - 1) / kTileSize) * ((height + kTileSize - 1) / kTileSize));
+}
+
+ImageTile get_image_tile(int const width, int const height, uint32_t const tile_index)
+{
+	int const tiles_per_row = (width + kTileSize - 1) / kTileSize;
+
+	ImageTile tile;
+	tile.x = static_cast<int>(tile_index % tiles_per_row) * kTileSize;
+	tile.y = static_cast<int>(tile_index / tiles_per_row) * kTileSize;
+	tile.width = std::min(kTileSize, width - tile.x);
+	tile.height = std::min(kTileSize, height - tile.y);
+	return tile;
+}
+
+// Render one tile into its pixels of the shared image; tiles never overlap, so no other thread writes there. The camera
+// rays of one pixel's samples are traced in packets, for the shared node fetches, and the rest of each path alone.
+void path_trace(Scene const& scene, bool const ray_packets, SamplerSetup const& sampler_setup, ImageTile const& tile, Image& image)
+{
+	Vec3 const camera_position = kCameraPosition;
+	float const image_plane_size = kImagePlaneSize;
+
+	int const width = image.width;
+	int const height = image.height;
+	int const samples_per_pixel = static_cast<int>(sampler_setup.sample_count);
 	float const sample_weight = 1.f / static_cast<float>(samples_per_pixel);
 
-	image.width = width;
-	image.height = height;
-	image.pixels = new RGB[image.width * image.height];
+	for (int y = tile.y; y < tile.y + tile.height; ++y)
+	{
+		for (int x = tile.x; x < tile.x + tile.width; ++x)
+		{
+			for (int first_sample = 0; first_sample < samples_per_pixel; first_sample += kRayPacketSize)
+			{
+				uint32_t const ray_count = std::min<uint32_t>(kRayPacketSize, samples_per_pixel - first_sample);
+
+				PathSampler samplers[kRayPacketSize];
+				Ray camera_rays[kRayPacketSize];
+				for (uint32_t n = 0; n < ray_count; ++n)
+				{
+					samplers[n] = make_path_sampler(sampler_setup, static_cast<uint32_t>(y * width + x), first_sample + n);
+					float u1, u2;
+					sample_2d(samplers[n], u1, u2);
+					CameraSample const camera_sample = jittered_camera_sample(x, y, width, height, u1, u2);
+					Vec3 const image_plane_direction(camera_sample.x * image_plane_size, camera_sample.y * image_plane_size, -1.f);
+					camera_rays[n] = Ray(camera_position, image_plane_direction);
+				}
+
+				Intersection camera_intersects[kRayPacketSize];
+				if (ray_packets)
+				{
+					intersect_scene_packet(camera_rays, ray_count, scene, camera_intersects);
+				}
+				else
+				{
+					for (uint32_t n = 0; n < ray_count; ++n)
+						camera_intersects[n] = intersect_scene(camera_rays[n], scene);
+				}
+
+				for (uint32_t n = 0; n < ray_count; ++n)
+				{
+					RGB const sample = sample_image(camera_rays[n], camera_intersects[n], scene, samplers[n]);
+					image.pixels[y * width + x] += sample * sample_weight;
+				}
+			}
+		}
+	}
+}
+
+uint32_t const kWavefrontPathCount = 1u << 14; // paths in flight on each thread, a whole tile at 16 samples per pixel
+
+// Wavefront path state, one slot per path in flight and one array per field.
+struct WavefrontPaths
+{
+	std::vector<uint32_t> pixel_index;
+	std::vector<Ray> ray;
+	std::vector<Intersection> intersect;
+	std::vector<RGB> throughput;
+	std::vector<float> last_forward_sampling_probability_density;
+	std::vector<int> path_length;
+	std::vector<PathSampler> sampler;
+	std::vector<PathVertexSamples> vertex_samples; // drawn when the vertex is shaded, kept for its BSDF sample
+};
+
+// Shadow rays waiting for their occlusion test, with the pixels they light.
+struct WavefrontShadowQueue
+{
+	std::vector<uint32_t> pixel_index;
+	std::vector<ShadowRay> shadow_ray;
+};
 
-	for (int y = 0; y < height; ++y)
+struct WavefrontStats
+{
+	uint64_t ray_count; // extension and shadow rays
+	uint64_t node_fetch_count; // stays zero unless count_node_fetches is on
+	double sort_seconds;
+	double shade_seconds;
+};
+
+// Spread the low 10 bits of value out to every third bit.
+uint32_t spread_morton_bits(uint32_t value)
+{
+	value &= 0x3ff;
+	value = (value | (value << 16)) & 0x30000ff;
+	value = (value | (value << 8)) & 0x300f00f;
+	value = (value | (value << 4)) & 0x30c30c3;
+	value = (value | (value << 2)) & 0x9249249;
+	return value;
+}
+
+uint32_t quantize_morton_coordinate(float const value, float const min, float const extent, uint32_t const steps)
+{
+	float const q = (extent > 0.f) ? (value - min) / extent * static_cast<float>(steps) : 0.f;
+	return static_cast<uint32_t>(std::min(std::max(q, 0.f), static_cast<float>(steps - 1)));
+}
+
+// Rays sort by direction octant, then by the Morton code of their origin in the scene bounds, then by a coarser Morton
+// code of their direction, which keeps rays from one point (like the camera's) in order.
+uint64_t ray_sort_key(Ray const& ray, Aabb const& scene_bounds)
+{
+	Vec3 const& origin = ray.origin;
+	Vec3 const& direction = ray.direction;
+	Vec3 const extent = scene_bounds.max - scene_bounds.min;
+
+	uint64_t const octant = (direction.x < 0.f) | ((direction.y < 0.f) << 1) | ((direction.z < 0.f) << 2);
+	uint64_t const origin_code =
+		spread_morton_bits(quantize_morton_coordinate(origin.x, scene_bounds.min.x, extent.x, 512)) |
+		(spread_morton_bits(quantize_morton_coordinate(origin.y, scene_bounds.min.y, extent.y, 512)) << 1) |
+		(spread_morton_bits(quantize_morton_coordinate(origin.z, scene_bounds.min.z, extent.z, 512)) << 2);
+	uint64_t const direction_code =
+		spread_morton_bits(quantize_morton_coordinate(direction.x, -1.f, 2.f, 64)) |
+		(spread_morton_bits(quantize_morton_coordinate(direction.y, -1.f, 2.f, 64)) << 1) |
+		(spread_morton_bits(quantize_morton_coordinate(direction.z, -1.f, 2.f, 64)) << 2);
+	return (octant << 45) | (origin_code << 18) | direction_code;
+}
+
+// Reorder indices into rays by their sort keys; the index fills the low bits, so it must fit in 64 - 48 bits.
+template <typename GetRay>
+void sort_rays(std::vector<uint32_t>& ray_indices, GetRay const& get_ray, Aabb const& scene_bounds, std::vector<uint64_t>& keys)
+{
+	keys.clear();
+	for (uint32_t const ray_index : ray_indices)
+	{
+		keys.push_back((ray_sort_key(get_ray(ray_index), scene_bounds) << 16) | ray_index);
+	}
+	std::sort(keys.begin(), keys.end());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		ray_indices[i] = static_cast<uint32_t>(keys[i] & 0xffff);
+	}
+}
+
+uint32_t const kMaxMaterialCount = 256; // material indices are 8-bit
+uint32_t const kMissBucket = kMaxMaterialCount;
+
+// Group slots by the material they hit, keeping their order within a material, with misses in a last bucket. Bucket b
+// runs from bucket_starts[b] to bucket_starts[b + 1].
+void bucket_by_material(std::vector<uint32_t>& slots, Intersection const* const intersects, uint8_t const* const material_indices,
+	uint32_t bucket_starts[kMissBucket + 2], std::vector<uint32_t>& scratch)
+{
+	uint32_t counts[kMissBucket + 1] = {};
+	for (uint32_t const slot : slots)
+	{
+		Intersection const& intersect = intersects[slot];
+		++counts[intersect.valid() ? material_indices[intersect.triangle_index] : kMissBucket];
+	}
+
+	bucket_starts[0] = 0;
+	for (uint32_t bucket = 0; bucket <= kMissBucket; ++bucket)
+	{
+		bucket_starts[bucket + 1] = bucket_starts[bucket] + counts[bucket];
+		counts[bucket] = bucket_starts[bucket];
+	}
+
+	scratch.resize(slots.size());
+	for (uint32_t const slot : slots)
+	{
+		Intersection const& intersect = intersects[slot];
+		scratch[counts[intersect.valid() ? material_indices[intersect.triangle_index] : kMissBucket]++] = slot;
+	}
+	slots.swap(scratch);
+}
+
+// The same paths as path_trace, but advanced a stage at a time: every path waiting to be extended is intersected, then
+// every hit is shaded, then every shadow ray is tested, and finished paths make room for new camera paths. Each stage
+// is a tight loop over thousands of paths that keeps its own code and data hot. Tiles are taken from next_tile_index
+// whenever the current one has no camera paths left to start, so the slots stay full until the last tile.
+void path_trace_wavefront(Scene const& scene, bool const sort_queues, bool const ray_packets, bool const sort_shading, SamplerSetup const& sampler_setup,
+	std::atomic<uint32_t>& next_tile_index, Image& image, WavefrontStats& stats)
+{
+	static_assert(kWavefrontPathCount <= 0x10000, "slots are sorted as 16-bit indices");
+	Vec3 const camera_position = kCameraPosition;
+	float const image_plane_size = kImagePlaneSize;
+
+	int const width = image.width;
+	int const height = image.height;
+	int const samples_per_pixel = static_cast<int>(sampler_setup.sample_count);
+	float const sample_weight = 1.f / static_cast<float>(samples_per_pixel);
+	float const continue_probability = 0.8f;
+
+	WavefrontPaths paths;
+	paths.pixel_index.resize(kWavefrontPathCount);
+	paths.ray.resize(kWavefrontPathCount);
+	paths.intersect.resize(kWavefrontPathCount);
+	paths.throughput.resize(kWavefrontPathCount);
+	paths.last_forward_sampling_probability_density.resize(kWavefrontPathCount);
+	paths.path_length.resize(kWavefrontPathCount);
+	paths.sampler.resize(kWavefrontPathCount);
+	paths.vertex_samples.resize(kWavefrontPathCount);
+
+	std::vector<uint32_t> free_slots;
+	std::vector<uint32_t> extend_queue;
+	std::vector<uint32_t> shade_queue;
+	std::vector<uint32_t> terminate_queue;
+	WavefrontShadowQueue shadow_queue;
+	free_slots.reserve(kWavefrontPathCount);
+	extend_queue.reserve(kWavefrontPathCount);
+	shade_queue.reserve(kWavefrontPathCount);
+	terminate_queue.reserve(kWavefrontPathCount);
+	shadow_queue.pixel_index.reserve(kWavefrontPathCount);
+	shadow_queue.shadow_ray.reserve(kWavefrontPathCount);
+	for (uint32_t slot = kWavefrontPathCount; slot > 0; --slot)
+	{
+		free_slots.push_back(slot - 1);
+	}
+
+	Aabb const scene_bounds = (scene.tlas.bvh.node_count) ? scene.tlas.bvh.nodes[0].bounds : Aabb();
+	std::vector<uint64_t> sort_keys;
+	std::vector<uint32_t> shadow_order;
+	sort_keys.reserve(kWavefrontPathCount);
+	shadow_order.reserve(kWavefrontPathCount);
+
+	uint32_t material_bucket_starts[kMissBucket + 2];
+	std::vector<uint32_t> shade_scratch;
+	std::vector<uint32_t> lambert_queue;
+	std::vector<uint32_t> ggx_smith_queue;
+	shade_scratch.reserve(kWavefrontPathCount);
+	lambert_queue.reserve(kWavefrontPathCount);
+	ggx_smith_queue.reserve(kWavefrontPathCount);
+
+	uint32_t const tile_count = get_image_tile_count(width, height);
+	ImageTile tile = {};
+	uint32_t sample_count = 0;
+	uint32_t next_sample = 0;
+	bool tiles_left = true;
+
+	for (;;)
+	{
+		// Start camera paths in the free slots, moving on to the next tile once this one's are all started.
+		//
+
+		while (!free_slots.empty() && tiles_left)
+		{
+			if (next_sample == sample_count)
+			{
+				uint32_t const tile_index = next_tile_index++;
+				tiles_left = tile_index < tile_count;
+				if (tiles_left)
+				{
+					tile = get_image_tile(width, height, tile_index);
+					sample_count = static_cast<uint32_t>(tile.width * tile.height * samples_per_pixel);
+					next_sample = 0;
+				}
+				continue;
+			}
+
+			uint32_t const slot = free_slots.back();
+			free_slots.pop_back();
+
+			uint32_t const tile_pixel_index = next_sample / samples_per_pixel;
+			uint32_t const sample_index = next_sample++ % samples_per_pixel;
+			int const x = tile.x + static_cast<int>(tile_pixel_index % tile.width);
+			int const y = tile.y + static_cast<int>(tile_pixel_index / tile.width);
+			uint32_t const pixel_index = static_cast<uint32_t>(y * width + x);
+			paths.sampler[slot] = make_path_sampler(sampler_setup, pixel_index, sample_index);
+			float u1, u2;
+			sample_2d(paths.sampler[slot], u1, u2);
+			CameraSample const camera_sample = jittered_camera_sample(x, y, width, height, u1, u2);
+			Vec3 const image_plane_direction(camera_sample.x * image_plane_size, camera_sample.y * image_plane_size, -1.f);
+
+			paths.pixel_index[slot] = pixel_index;
+			paths.ray[slot] = Ray(camera_position, image_plane_direction);
+			paths.throughput[slot] = RGB(1.f, 1.f, 1.f);
+			paths.last_forward_sampling_probability_density[slot] = 0.f;
+			paths.path_length[slot] = 0;
+			extend_queue.push_back(slot);
+		}
+
+		if (extend_queue.empty())
+			break;
+
+		// Extend every path by one vertex.
+		//
+
+		if (sort_queues)
+		{
+			auto const sort_start = std::chrono::steady_clock::now();
+			sort_rays(extend_queue, [&](uint32_t const slot) -> Ray const& { return paths.ray[slot]; }, scene_bounds, sort_keys);
+			stats.sort_seconds += seconds_since(sort_start);
+		}
+
+		// Packets are used whether or not the queue is sorted, so sorting is measured on its own; sorted neighbours are
+		// simply more likely to share node fetches.
+		uint64_t const extend_fetch_start = bvh_node_fetch_count;
+		if (ray_packets)
+		{
+			uint32_t const extend_count = static_cast<uint32_t>(extend_queue.size());
+			for (uint32_t first = 0; first < extend_count; first += kRayPacketSize)
+			{
+				uint32_t const ray_count = std::min(extend_count - first, kRayPacketSize);
+				Ray rays[kRayPacketSize];
+				Intersection intersects[kRayPacketSize];
+				for (uint32_t n = 0; n < ray_count; ++n)
+					rays[n] = paths.ray[extend_queue[first + n]];
+				intersect_scene_packet(rays, ray_count, scene, intersects);
+				for (uint32_t n = 0; n < ray_count; ++n)
+					paths.intersect[extend_queue[first + n]] = intersects[n];
+			}
+		}
+		else
+		{
+			for (uint32_t const slot : extend_queue)
+				paths.intersect[slot] = intersect_scene(paths.ray[slot], scene);
+		}
+		for (uint32_t const slot : extend_queue)
+		{
+			paths.path_length[slot]++;
+		}
+		stats.ray_count += extend_queue.size();
+		stats.node_fetch_count += bvh_node_fetch_count - extend_fetch_start;
+		shade_queue.swap(extend_queue);
+		extend_queue.clear();
+
+		// Shade every new vertex, queueing its shadow ray and its next ray.
+		//
+
+		// As in sample_image, only the skydome is found implicitly.
+		auto const shade_miss = [&](uint32_t const slot)
+		{
+			Ray const& ray = paths.ray[slot];
+			SurfaceRadiance const surface = scene_light_radiance(scene, ray.direction);
+			if (surface.is_light)
+			{
+				image.pixels[paths.pixel_index[slot]] += implicit_path_sample(scene, ray, surface, paths.path_length[slot], paths.throughput[slot],
+					paths.last_forward_sampling_probability_density[slot]) * sample_weight;
+			}
+			terminate_queue.push_back(slot);
+		};
+
+		// Queue the vertex's shadow ray and play russian roulette; true if the path goes on and needs a BSDF sample.
+		auto const shade_hit = [&](uint32_t const slot, Material const& material) -> bool
+		{
+			Ray const& ray = paths.ray[slot];
+			Intersection const& intersect = paths.intersect[slot];
+			RGB& path_throughput = paths.throughput[slot];
+			Vec3 const biased_point = intersect.point + intersect.normal * 1e-3f; // Avoid acne from self-shadowing.
+			PathVertexSamples& samples = paths.vertex_samples[slot];
+			samples = draw_path_vertex_samples(paths.sampler[slot]);
+
+			ShadowRay shadow_ray;
+			if (explicit_path_sample(scene, ray, intersect, material, biased_point, path_throughput, samples, shadow_ray))
+			{
+				shadow_queue.pixel_index.push_back(paths.pixel_index[slot]);
+				shadow_queue.shadow_ray.push_back(shadow_ray);
+			}
+
+			if (paths.path_length[slot] > 3)
+			{
+				if (sample_russian_roulette(continue_probability, samples.roulette))
+				{
+					terminate_queue.push_back(slot);
+					return false;
+				}
+				path_throughput /= continue_probability;
+			}
+			return true;
+		};
+
+		auto const extend_path = [&](uint32_t const slot, BsdfSample const& bsdf_sample)
+		{
+			if (bsdf_sample.probability_density == 0.f)
+			{
+				terminate_queue.push_back(slot);
+				return;
+			}
+			Intersection const& intersect = paths.intersect[slot];
+			Vec3 const biased_point = intersect.point + intersect.normal * 1e-3f;
+			paths.ray[slot] = Ray(biased_point, bsdf_sample.direction);
+			paths.throughput[slot] *= bsdf_sample.reflectance * (dot(bsdf_sample.direction, intersect.normal) / bsdf_sample.probability_density);
+			paths.last_forward_sampling_probability_density[slot] = bsdf_sample.probability_density;
+			extend_queue.push_back(slot);
+		};
+
+		auto const shade_start = std::chrono::steady_clock::now();
+		if (sort_shading)
+		{
+			// A material at a time, and within it a lobe at a time, so each pass runs one BSDF's code over one material's
+			// parameters with no branch on the lobe.
+			bucket_by_material(shade_queue, paths.intersect.data(), scene.material_indices, material_bucket_starts, shade_scratch);
+			for (uint32_t bucket = 0; bucket < kMissBucket; ++bucket)
+			{
+				uint32_t const begin = material_bucket_starts[bucket];
+				uint32_t const end = material_bucket_starts[bucket + 1];
+				if (begin == end)
+					continue;
+
+				Material const material = scene.materials[bucket];
+				lambert_queue.clear();
+				ggx_smith_queue.clear();
+				for (uint32_t i = begin; i < end; ++i)
+				{
+					uint32_t const slot = shade_queue[i];
+					if (shade_hit(slot, material))
+						((paths.vertex_samples[slot].bsdf_lobe < 0.5f) ? lambert_queue : ggx_smith_queue).push_back(slot);
+				}
+				for (uint32_t const slot : lambert_queue)
+				{
+					Intersection const& intersect = paths.intersect[slot];
+					PathVertexSamples const& samples = paths.vertex_samples[slot];
+					extend_path(slot, surface_bsdf_lambert_sample(-paths.ray[slot].direction, material, intersect.normal, intersect.tangent, samples.bsdf[0], samples.bsdf[1]));
+				}
+				for (uint32_t const slot : ggx_smith_queue)
+				{
+					Intersection const& intersect = paths.intersect[slot];
+					PathVertexSamples const& samples = paths.vertex_samples[slot];
+					extend_path(slot, surface_bsdf_ggx_smith_sample(-paths.ray[slot].direction, material, intersect.normal, intersect.tangent, samples.bsdf[0], samples.bsdf[1]));
+				}
+			}
+			for (uint32_t i = material_bucket_starts[kMissBucket]; i < material_bucket_starts[kMissBucket + 1]; ++i)
+			{
+				shade_miss(shade_queue[i]);
+			}
+		}
+		else
+		{
+			for (uint32_t const slot : shade_queue)
+			{
+				Intersection const& intersect = paths.intersect[slot];
+				if (!intersect.valid())
+				{
+					shade_miss(slot);
+					continue;
+				}
+
+				Material const& material = scene.materials[scene.material_indices[intersect.triangle_index]];
+				if (shade_hit(slot, material))
+				{
+					PathVertexSamples const& samples = paths.vertex_samples[slot];
+					extend_path(slot, surface_bsdf_sample(-paths.ray[slot].direction, material, intersect.normal, intersect.tangent, samples.bsdf_lobe, samples.bsdf[0], samples.bsdf[1]));
+				}
+			}
+		}
+		stats.shade_seconds += seconds_since(shade_start);
+		shade_queue.clear();
+
+		// Test every shadow ray.
+		//
+
+		uint32_t const shadow_count = static_cast<uint32_t>(shadow_queue.shadow_ray.size());
+		shadow_order.clear();
+		for (uint32_t i = 0; i < shadow_count; ++i)
+		{
+			shadow_order.push_back(i);
+		}
+
+		if (sort_queues)
+		{
+			auto const sort_start = std::chrono::steady_clock::now();
+			sort_rays(shadow_order, [&](uint32_t const i) -> Ray const& { return shadow_queue.shadow_ray[i].ray; }, scene_bounds, sort_keys);
+			stats.sort_seconds += seconds_since(sort_start);
+		}
+
+		uint64_t const shadow_fetch_start = bvh_node_fetch_count;
+		for (uint32_t const i : shadow_order)
+		{
+			ShadowRay const& shadow_ray = shadow_queue.shadow_ray[i];
+			if (!occluded_scene(shadow_ray.ray, shadow_ray.t_max, scene))
+			{
+				image.pixels[shadow_queue.pixel_index[i]] += shadow_ray.contribution * sample_weight;
+			}
+		}
+		stats.ray_count += shadow_count;
+		stats.node_fetch_count += bvh_node_fetch_count - shadow_fetch_start;
+		shadow_queue.pixel_index.clear();
+		shadow_queue.shadow_ray.clear();
+
+		// Free the slots of finished paths.
+		//
+
+		free_slots.insert(free_slots.end(), terminate_queue.begin(), terminate_queue.end());
+		terminate_queue.clear();
+	}
+}
+
+struct Options
+{
+	char const* scene_path;
+	bool triangle_records;
+	uint32_t simd_width;
+	uint32_t bvh_width;
+	uint32_t build_thread_count;
+	uint32_t render_thread_count;
+	bool spatial_splits;
+	bool quantized_nodes;
+	uint32_t frame_count;
+	float rebuild_threshold;
+	bool ray_packets;
+	bool skydome; // light the scene with the skydome instead of its own emissive triangles
+	bool light_tree; // sample emissive triangles by their estimated contribution instead of by power alone
+	bool wavefront;
+	bool sort_rays; // wavefront queues only
+	bool sort_shading; // wavefront hits by material
+	bool count_node_fetches; // in wavefront traversals, to report node fetches per ray
+	bool bench_traversal; // only run the ray traversal benchmarks once the scene is built
+	bool bench_random; // only run the random number benchmark
+	bool bench_skydome; // only run the skydome mapping benchmark once the skydome is loaded
+	uint32_t sampler_type;
+	uint32_t samples_per_pixel;
+};
+
+bool parse_options(int const argc, char const* const argv[], Options& options)
+{
+	options.scene_path = "CornellBox-Original.obj";
+	options.triangle_records = true;
+	options.simd_width = detect_simd_width();
+	options.bvh_width = options.simd_width;
+	options.build_thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+	options.render_thread_count = options.build_thread_count;
+	options.spatial_splits = false;
+	options.quantized_nodes = false;
+	options.frame_count = 1;
+	options.rebuild_threshold = 1.5f;
+	options.ray_packets = true;
+	options.skydome = true;
+	options.light_tree = false;
+	options.wavefront = false;
+	options.sort_rays = false;
+	options.sort_shading = false;
+	options.count_node_fetches = false;
+	options.bench_traversal = false;
+	options.bench_random = false;
+	options.bench_skydome = false;
+	options.sampler_type = kSamplerSobol;
+	options.samples_per_pixel = 16;
+
+	for (int arg_index = 1; arg_index < argc; ++arg_index)
 	{
-		for (int x = 0; x < width; ++x)
+		char const* const arg = argv[arg_index];
+		if (0 == strcmp(arg, "--no-triangle-records"))
+			options.triangle_records = false;
+		else if (0 == strcmp(arg, "--simd=1"))
+			options.simd_width = 1;
+		else if (0 == strcmp(arg, "--simd=4"))
+			options.simd_width = 4;
+		else if (0 == strcmp(arg, "--simd=8"))
 		{
-			for (int n = 0; n < samples_per_pixel; ++n)
+			if (!cpu_supports_avx())
 			{
-				CameraSample const camera_sample = random_camera_sample(x, y, width, height, random_engine);
-				Vec3 const image_plane_direction(camera_sample.x * image_plane_size, camera_sample.y * image_plane_size, -1.f);
-				RGB const sample = sample_image(camera_position, image_plane_direction, scene, random_engine);
-				image.pixels[y * width + x] += sample * sample_weight;
+				fputs("--simd=8 needs AVX, which this CPU does not support\n", stderr);
+				return false;
 			}
+			options.simd_width = 8;
 		}
+		else if (0 == strcmp(arg, "--bvh-width=2"))
+			options.bvh_width = 2;
+		else if (0 == strcmp(arg, "--bvh-width=4"))
+			options.bvh_width = 4;
+		else if (0 == strcmp(arg, "--bvh-width=8"))
+			options.bvh_width = 8;
+		else if (0 == strcmp(arg, "--sbvh"))
+			options.spatial_splits = true;
+		else if (0 == strcmp(arg, "--quantized-bvh"))
+			options.quantized_nodes = true;
+		else if (0 == strcmp(arg, "--no-ray-packets"))
+			options.ray_packets = false;
+		else if (0 == strcmp(arg, "--no-skydome"))
+			options.skydome = false;
+		else if (0 == strcmp(arg, "--light-sampler=power"))
+			options.light_tree = false;
+		else if (0 == strcmp(arg, "--light-sampler=tree"))
+			options.light_tree = true;
+		else if (0 == strcmp(arg, "--wavefront"))
+			options.wavefront = true;
+		else if (0 == strcmp(arg, "--sort-rays"))
+			options.sort_rays = true;
+		else if (0 == strcmp(arg, "--sort-shading"))
+			options.sort_shading = true;
+		else if (0 == strcmp(arg, "--count-node-fetches"))
+			options.count_node_fetches = true;
+		else if (0 == strcmp(arg, "--sampler=random"))
+			options.sampler_type = kSamplerRandom;
+		else if (0 == strcmp(arg, "--sampler=sobol"))
+			options.sampler_type = kSamplerSobol;
+		else if (0 == strcmp(arg, "--sampler=bluenoise"))
+			options.sampler_type = kSamplerBlueNoise;
+		else if (0 == strncmp(arg, "--samples=", 10) && atoi(arg + 10) > 0)
+			options.samples_per_pixel = static_cast<uint32_t>(atoi(arg + 10));
+		else if (0 == strcmp(arg, "--bench-traversal"))
+			options.bench_traversal = true;
+		else if (0 == strcmp(arg, "--bench-random"))
+			options.bench_random = true;
+		else if (0 == strcmp(arg, "--bench-skydome"))
+			options.bench_skydome = true;
+		else if (0 == strncmp(arg, "--build-threads=", 16) && atoi(arg + 16) > 0)
+			options.build_thread_count = static_cast<uint32_t>(atoi(arg + 16));
+		else if (0 == strncmp(arg, "--render-threads=", 17) && atoi(arg + 17) > 0)
+			options.render_thread_count = static_cast<uint32_t>(atoi(arg + 17));
+		else if (0 == strncmp(arg, "--frames=", 9) && atoi(arg + 9) > 0)
+			options.frame_count = static_cast<uint32_t>(atoi(arg + 9));
+		else if (0 == strncmp(arg, "--rebuild-threshold=", 20) && atof(arg + 20) >= 0.0)
+			options.rebuild_threshold = static_cast<float>(atof(arg + 20));
+		else if (arg[0] != '-')
+			options.scene_path = arg;
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", arg);
+			return false;
+		}
+	}
+
+	if (options.bench_skydome && !options.skydome)
+	{
+		fputs("--bench-skydome needs the skydome\n", stderr);
+		return false;
+	}
+
+	if (options.count_node_fetches && !options.wavefront)
+	{
+		fputs("--count-node-fetches needs --wavefront\n", stderr);
+		return false;
 	}
+
+	// SIMD leaves test blocks of triangles copied out of the index and vertex arrays, so they have no index-based layout.
+	if (!options.triangle_records && options.simd_width > 1)
+	{
+		fputs("--no-triangle-records needs --simd=1\n", stderr);
+		return false;
+	}
+
+	return true;
+}
+
+Bvh build_blas_bvh(Blas const& blas, uint32_t const* const indices, Vec3 const* const vertices, Options const& options, ThreadPool& build_pool)
+{
+	uint32_t const* const blas_indices = indices + 3u * blas.triangle_index;
+
+	float const kSbvhReferenceBudget = 1.3f; // at most 30% more references than triangles
+	Bvh bvh = (options.spatial_splits)
+		? build_triangle_sbvh(blas.triangle_count, blas_indices, vertices, options.simd_width, kSbvhReferenceBudget)
+		: build_triangle_bvh(blas.triangle_count, blas_indices, vertices, options.simd_width, &build_pool);
+	if (options.simd_width > 1)
+		build_bvh_triangle_blocks(bvh, options.simd_width, blas_indices, vertices);
+	else if (options.triangle_records)
+		build_bvh_triangle_records(bvh, blas_indices, vertices);
+	if (options.bvh_width > 2)
+		build_bvh_wide_nodes(bvh, options.bvh_width, (cpu_supports_avx()) ? 8 : 4);
+	if (options.quantized_nodes)
+		build_bvh_quantized_nodes(bvh);
+	return bvh;
+}
+
+// A turntable: each bottom-level BVH's rest pose turned about the vertical axis through the centre of its bounds, so its
+// instances spin in place wherever they sit. Animated scenes give every mesh its own bottom-level BVH, so each one spins
+// on its own rather than the baked meshes turning together as one body.
+void spin_vertices(Scene const& scene, Vec3 const* const rest_vertices, float const angle, Vec3* const vertices)
+{
+	float const c = cosf(angle);
+	float const s = sinf(angle);
+	for (uint32_t blas_index = 0; blas_index < scene.tlas.blas_count; ++blas_index)
+	{
+		Blas const& blas = scene.tlas.blases[blas_index];
+		uint32_t const* const blas_indices = scene.indices + 3u * blas.triangle_index;
+		uint32_t const blas_index_count = 3u * blas.triangle_count;
+
+		Aabb rest_bounds;
+		for (uint32_t i = 0; i < blas_index_count; ++i)
+		{
+			rest_bounds = aabb_union(rest_bounds, rest_vertices[blas_indices[i]]);
+		}
+		Vec3 const center = aabb_centroid(rest_bounds);
+
+		// Vertices shared by several triangles are turned once for each, always to the same place.
+		for (uint32_t i = 0; i < blas_index_count; ++i)
+		{
+			uint32_t const vertex_index = blas_indices[i];
+			Vec3 const v = rest_vertices[vertex_index] - center;
+			vertices[vertex_index] = center + Vec3(c * v.x + s * v.z, v.y, c * v.z - s * v.x);
+		}
+	}
+}
+
+// Bring the acceleration structures up to date after the vertices moved. Every bottom-level BVH is refit, and rebuilt
+// if that left its SAH cost more than rebuild_threshold times what it was after its last build; zero never rebuilds.
+void update_scene_geometry(Scene& scene, Blas* const blases, float* const built_sah_costs, Options const& options, ThreadPool& build_pool)
+{
+	auto const start = std::chrono::steady_clock::now();
+
+	uint32_t rebuild_count = 0;
+	for (uint32_t blas_index = 0; blas_index < scene.tlas.blas_count; ++blas_index)
+	{
+		Blas& blas = blases[blas_index];
+		refit_triangle_bvh(blas.bvh, scene.indices + 3u * blas.triangle_index, scene.vertices, &build_pool);
+		if (options.rebuild_threshold > 0.f && bvh_sah_cost(blas.bvh) > options.rebuild_threshold * built_sah_costs[blas_index])
+		{
+			free_bvh(blas.bvh);
+			blas.bvh = build_blas_bvh(blas, scene.indices, scene.vertices, options, build_pool);
+			built_sah_costs[blas_index] = bvh_sah_cost(blas.bvh);
+			rebuild_count++;
+		}
+	}
+
+	free_bvh(scene.tlas.bvh);
+	scene.tlas = build_tlas(scene.tlas.blas_count, blases, scene.tlas.instance_count, scene.tlas.instances);
+	if (!scene.skydome)
+		build_emissive_triangle_table(scene, options.light_tree);
+
+	printf("Refit %u bottom-level BVHs (%u rebuilt) in %.2f ms\n", scene.tlas.blas_count, rebuild_count, seconds_since(start) * 1e3);
+}
+
+// Tiles are handed out to the pool's threads, which render them straight into one shared image.
+bool render_frame(Scene const& scene, Options const& options, ThreadPool& thread_pool, uint32_t const frame_index, float const* const blue_noise,
+	char const* const image_path)
+{
+	uint32_t const thread_count = thread_pool_size(thread_pool);
+
+	SamplerSetup sampler_setup;
+	sampler_setup.type = options.sampler_type;
+	sampler_setup.sample_count = options.samples_per_pixel;
+	sampler_setup.frame_index = frame_index;
+	sampler_setup.image_width = kImageWidth;
+	sampler_setup.blue_noise = blue_noise;
+
+	Image image = {};
+	image.width = kImageWidth;
+	image.height = kImageHeight;
+	image.pixels = new RGB[image.width * image.height];
+	std::vector<WavefrontStats> wavefront_stats(thread_count, WavefrontStats());
+
+	auto const render_start = std::chrono::steady_clock::now();
+
+	uint32_t const tile_count = get_image_tile_count(image.width, image.height);
+	if (options.wavefront)
+	{
+		// One long-lived wavefront per thread, each refilling its path slots from whichever tile is next.
+		std::atomic<uint32_t> next_tile_index(0);
+		run_thread_pool_tasks(thread_pool, thread_count, [&](uint32_t const thread_index, uint32_t)
+		{
+			bvh_count_node_fetches = options.count_node_fetches;
+			path_trace_wavefront(scene, options.sort_rays, options.ray_packets, options.sort_shading, sampler_setup, next_tile_index, image, wavefront_stats[thread_index]);
+			bvh_count_node_fetches = false;
+		});
+	}
+	else
+	{
+		run_thread_pool_tasks(thread_pool, tile_count, [&](uint32_t, uint32_t const tile_index)
+		{
+			path_trace(scene, options.ray_packets, sampler_setup, get_image_tile(image.width, image.height, tile_index), image);
+		});
+	}
+
+	printf("Rendered %u tiles in %.2f s on %u threads\n", tile_count, seconds_since(render_start), thread_count);
+
+	if (options.wavefront)
+	{
+		WavefrontStats total = {};
+		for (WavefrontStats const& stats : wavefront_stats)
+		{
+			total.ray_count += stats.ray_count;
+			total.node_fetch_count += stats.node_fetch_count;
+			total.sort_seconds += stats.sort_seconds;
+			total.shade_seconds += stats.shade_seconds;
+		}
+		if (options.count_node_fetches)
+			printf("Wavefront: %llu rays %s, extended %s, %.1f node fetches per ray, %.2f s sorting, %.2f s shading %s\n",
+				static_cast<unsigned long long>(total.ray_count), options.sort_rays ? "sorted" : "unsorted", options.ray_packets ? "in packets" : "one at a time",
+				static_cast<double>(total.node_fetch_count) / static_cast<double>(std::max(total.ray_count, uint64_t(1))),
+				total.sort_seconds, total.shade_seconds, options.sort_shading ? "by material" : "in queue order");
+		else
+			printf("Wavefront: %llu rays %s, extended %s, %.2f s sorting, %.2f s shading %s\n", static_cast<unsigned long long>(total.ray_count),
+				options.sort_rays ? "sorted" : "unsorted", options.ray_packets ? "in packets" : "one at a time", total.sort_seconds, total.shade_seconds,
+				options.sort_shading ? "by material" : "in queue order");
+	}
+
+	bool const written = write_rgbe(image_path, image);
+	delete[] image.pixels;
+	return written;
 }
 
 int main(int const argc, char const* const argv[])
 {
-	(void)argc;
-	(void)argv;
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		fputs("Usage: akuna [--no-triangle-records] [--simd=1|4|8] [--bvh-width=2|4|8] [--build-threads=n] [--render-threads=n] [--sbvh] [--quantized-bvh] [--frames=n] [--rebuild-threshold=x] [--no-ray-packets] [--no-skydome] [--light-sampler=power|tree] [--wavefront] [--sort-rays] [--sort-shading] [--count-node-fetches] [--sampler=random|sobol|bluenoise] [--samples=n] [--bench-traversal] [--bench-random] [--bench-skydome] [scene]\n", stderr);
+		return 1;
+	}
+
+	if (options.bench_random)
+	{
+		print_random_report();
+		return 0;
+	}
+	char const* const scene_path = options.scene_path;
+
+	// Builds keep one set of threads for the whole run rather than starting new ones for every pass.
+	ThreadPool* const build_pool = create_thread_pool(options.build_thread_count);
 
 	Scene scene = {};
 
+	// Kept writable so frames can move the vertices and refit the bottom-level BVHs.
+	Vec3* vertices = nullptr;
+	Blas* blases = nullptr;
+
 	Assimp::Importer importer;
-	if (aiScene const* const imp_scene = importer.ReadFile("CornellBox-Original.obj", aiProcess_Triangulate | aiProcess_SortByPType))
+	if (aiScene const* const imp_scene = importer.ReadFile(scene_path, aiProcess_Triangulate | aiProcess_SortByPType))
 	{
-		SceneSizes const sizes = get_scene_sizes(imp_scene);
-
 		uint32_t const mesh_count = imp_scene->mNumMeshes;
+
+		std::vector<MeshPlacement> placements;
+		gather_mesh_placements(imp_scene->mRootNode, Mat34(), placements);
+		std::vector<uint32_t> placement_counts(mesh_count);
+		std::vector<Mat34> baked_transforms(mesh_count);
+		for (MeshPlacement const& placement : placements)
+		{
+			placement_counts[placement.mesh_index]++;
+			baked_transforms[placement.mesh_index] = placement.object_to_world;
+		}
+
+		// Animation spins every bottom-level BVH about its own centre, so meshes are only baked together for stills.
+		bool const bake = (1 == options.frame_count);
+		SceneSizes const sizes = get_scene_sizes(imp_scene, placement_counts.data(), bake);
+
 		uint32_t const triangle_count = sizes.triangle_count;
 		uint32_t const index_count = 3 * triangle_count;
 		uint32_t const vertex_count = sizes.vertex_count;
 		uint32_t const material_count = imp_scene->mNumMaterials;
 		uint32_t const light_count = sizes.light_count;
+		uint32_t const blas_count = sizes.blas_count;
+		uint32_t const instance_count = sizes.instance_count;
 
 		uint32_t* const indices = new uint32_t[index_count];
-		Vec3* const vertices = new Vec3[vertex_count];
+		vertices = new Vec3[vertex_count];
 		Material* const materials = new Material[material_count];
 		uint8_t* const material_indices = new uint8_t[triangle_count];
 		Light* const lights = new Light[light_count];
+		blases = new Blas[blas_count];
+		Instance* const instances = new Instance[instance_count];
 
 		for (uint32_t material_index = 0; material_index < material_count; ++material_index)
 		{
@@ -483,37 +1851,90 @@ int main(int const argc, char const* const argv[])
 		Vec3* current_vertex = vertices;
 		uint8_t* current_material_index = material_indices;
 		Light* current_light = lights;
+		Blas* current_blas = blases;
+		Instance* current_instance = instances;
 
-		for (uint32_t mesh_index = 0; mesh_index < mesh_count; ++mesh_index)
+		// Baked meshes first, so they form the first bottom-level BVH, then one bottom-level BVH per instanced mesh.
+		for (int pass = 0; pass < 2; ++pass)
 		{
-			aiMesh const* const imp_mesh = imp_scene->mMeshes[mesh_index];
-			if (aiPrimitiveType_TRIANGLE != imp_mesh->mPrimitiveTypes)
-				continue;
-
-			uint32_t const material_index = imp_mesh->mMaterialIndex;
-			Material const& material = materials[material_index];
-			if (material.is_light)
+			bool const baking = (0 == pass);
+			for (uint32_t mesh_index = 0; mesh_index < mesh_count; ++mesh_index)
 			{
-				Light& light = *current_light++;
-				light.triangle_index = current_triangle;
-				light.triangle_count = imp_mesh->mNumFaces;
+				aiMesh const* const imp_mesh = imp_scene->mMeshes[mesh_index];
+				uint32_t const placement_count = placement_counts[mesh_index];
+				if (aiPrimitiveType_TRIANGLE != imp_mesh->mPrimitiveTypes || !placement_count || baking != (bake && 1 == placement_count))
+					continue;
+
+				uint32_t const material_index = imp_mesh->mMaterialIndex;
+				Material const& material = materials[material_index];
+
+				if (baking)
+				{
+					if (material.is_light)
+					{
+						Light& light = *current_light++;
+						light.triangle_index = current_triangle;
+						light.triangle_count = imp_mesh->mNumFaces;
+						light.instance_index = 0;
+					}
+
+					Mat34 const& object_to_world = baked_transforms[mesh_index];
+					for (uint32_t vertex_index = 0; vertex_index < imp_mesh->mNumVertices; ++vertex_index)
+					{
+						aiVector3D const& imp_vertex = imp_mesh->mVertices[vertex_index];
+						current_vertex[vertex_index] = transform_point(object_to_world, Vec3(imp_vertex.x, imp_vertex.y, imp_vertex.z));
+					}
+				}
+				else
+				{
+					uint32_t const blas_index = static_cast<uint32_t>(current_blas - blases);
+					Blas& blas = *current_blas++;
+					blas.triangle_index = current_triangle;
+					blas.triangle_count = imp_mesh->mNumFaces;
+
+					for (MeshPlacement const& placement : placements)
+					{
+						if (placement.mesh_index != mesh_index)
+							continue;
+
+						if (material.is_light)
+						{
+							Light& light = *current_light++;
+							light.triangle_index = current_triangle;
+							light.triangle_count = imp_mesh->mNumFaces;
+							light.instance_index = static_cast<uint32_t>(current_instance - instances);
+						}
+						*current_instance++ = make_instance(blas_index, placement.object_to_world);
+					}
+
+					memcpy(current_vertex, imp_mesh->mVertices, imp_mesh->mNumVertices * sizeof(Vec3));
+				}
+
+				for (uint32_t triangle_index = 0; triangle_index < imp_mesh->mNumFaces; ++triangle_index)
+				{
+					aiFace const& imp_face = imp_mesh->mFaces[triangle_index];
+					for (uint32_t index_index = 0; index_index < imp_face.mNumIndices; ++index_index)
+						*current_index++ = base_index + imp_face.mIndices[index_index];
+					*current_material_index++ = static_cast<uint8_t>(material_index);
+				}
+
+				current_vertex += imp_mesh->mNumVertices;
+				base_index += imp_mesh->mNumVertices;
+				current_triangle += imp_mesh->mNumFaces;
 			}
 
-			for (uint32_t triangle_index = 0; triangle_index < imp_mesh->mNumFaces; ++triangle_index)
+			if (baking && current_triangle)
 			{
-				aiFace const& imp_face = imp_mesh->mFaces[triangle_index];
-				for (uint32_t index_index = 0; index_index < imp_face.mNumIndices; ++index_index)
-					*current_index++ = base_index + imp_face.mIndices[index_index];
-				*current_material_index++ = static_cast<uint8_t>(material_index);
+				Blas& blas = *current_blas++;
+				blas.triangle_index = 0;
+				blas.triangle_count = current_triangle;
+				*current_instance++ = make_instance(0, Mat34());
 			}
-
-			memcpy(current_vertex, imp_mesh->mVertices, imp_mesh->mNumVertices * sizeof(Vec3));
-			current_vertex += imp_mesh->mNumVertices;
-			base_index += imp_mesh->mNumVertices;
-			current_triangle += imp_mesh->mNumFaces;
 		}
 
 		scene.triangle_count = triangle_count;
+		scene.placed_triangle_count = sizes.placed_triangle_count;
+		scene.vertex_count = vertex_count;
 		scene.light_count = light_count;
 
 		scene.indices = indices;
@@ -521,62 +1942,113 @@ int main(int const argc, char const* const argv[])
 		scene.materials = materials;
 		scene.material_indices = material_indices;
 
+		auto const build_start = std::chrono::steady_clock::now();
+		for (uint32_t blas_index = 0; blas_index < blas_count; ++blas_index)
+		{
+			blases[blas_index].bvh = build_blas_bvh(blases[blas_index], indices, vertices, options, *build_pool);
+		}
+		double const blas_build_seconds = seconds_since(build_start);
+
+		auto const tlas_build_start = std::chrono::steady_clock::now();
+		scene.tlas = build_tlas(blas_count, blases, instance_count, instances);
+		double const tlas_build_seconds = seconds_since(tlas_build_start);
+
 		scene.lights = lights;
-		scene.light_area = get_scene_light_area(scene);
+
+		// The skydome replaces the scene's own lights in light sampling, so they only need sampling tables without it.
+		if (!options.skydome)
+		{
+			auto const light_tables_start = std::chrono::steady_clock::now();
+			build_emissive_triangle_table(scene, options.light_tree);
+			if (scene.light_tree.node_count)
+				printf("Built a light tree of %u nodes over %u emissive triangles in %.2f ms\n", scene.light_tree.node_count, scene.emissive_triangle_count,
+					seconds_since(light_tables_start) * 1e3);
+			else
+				printf("Built an alias table over %u emissive triangles in %.2f ms\n", scene.emissive_triangle_count, seconds_since(light_tables_start) * 1e3);
+		}
+
+		print_bvh_report(scene, blas_build_seconds, options.build_thread_count);
+		print_instancing_report(scene, tlas_build_seconds);
 	}
 	else
 	{
 		fprintf(stderr, "%s\n", importer.GetErrorString());
+		destroy_thread_pool(build_pool);
 		return 1;
 	}
 
 	Image skydome = {};
-	if (!read_rgbe("Barcelona_Rooftops/Barce_Rooftop_C_3k.hdr", skydome))
+	if (options.skydome)
 	{
-		fputs("Failed to read skydome image\n", stderr);
-		return 1;
+		if (!read_rgbe("Barcelona_Rooftops/Barce_Rooftop_C_3k.hdr", skydome))
+		{
+			fputs("Failed to read skydome image\n", stderr);
+			destroy_thread_pool(build_pool);
+			return 1;
+		}
+		auto const light_tables_start = std::chrono::steady_clock::now();
+		precompute_light_sampling_tables(skydome, *build_pool);
+		printf("Built skydome sampling tables in %.2f ms on %u threads\n", seconds_since(light_tables_start) * 1e3, options.build_thread_count);
+		scene.skydome = &skydome;
+		if (options.bench_skydome)
+		{
+			print_skydome_mapping_report(skydome);
+			destroy_thread_pool(build_pool);
+			return 0;
+		}
 	}
-	precompute_cumulative_probability_density(skydome);
-	scene.skydome = &skydome;
 
-	unsigned int const kMaxThreadCount = 16;
-	unsigned int const thread_count = std::max(std::min(std::thread::hardware_concurrency(), kMaxThreadCount) - 1u, 1u);
-	Image images[kMaxThreadCount] = {};
+	if (options.bench_traversal)
+	{
+		print_traversal_report(scene);
+		print_node_layout_report(scene);
+		print_packet_report(scene);
+		destroy_thread_pool(build_pool);
+		return 0;
+	}
 
-	std::vector<std::thread> threads;
-	threads.reserve(thread_count);
-	for (unsigned int thread_index = 0; thread_index < thread_count; ++thread_index)
+	std::vector<float> built_sah_costs(scene.tlas.blas_count);
+	for (uint32_t blas_index = 0; blas_index < scene.tlas.blas_count; ++blas_index)
 	{
-		Image& image = images[thread_index];
-		threads.emplace_back([&scene, &image]() { path_trace(scene, image); });
+		built_sah_costs[blas_index] = bvh_sah_cost(blases[blas_index].bvh);
 	}
-	for (std::thread& thread : threads)
+	std::vector<Vec3> const rest_vertices(vertices, vertices + scene.vertex_count);
+
+	float const* blue_noise = nullptr;
+	if (options.sampler_type == kSamplerBlueNoise)
 	{
-		thread.join();
+		auto const blue_noise_start = std::chrono::steady_clock::now();
+		blue_noise = build_blue_noise_tile(0);
+		printf("Built a %ux%u blue-noise tile in %.2f ms\n", kBlueNoiseTileSize, kBlueNoiseTileSize, seconds_since(blue_noise_start) * 1e3);
 	}
 
-	Image& final_image = images[0];
-	int const pixel_count = final_image.width * final_image.height;
-	float const image_weight = 1.f / static_cast<float>(thread_count);
+	ThreadPool* const thread_pool = create_thread_pool(options.render_thread_count);
 
-	for (unsigned int thread_index = 1; thread_index < thread_count; ++thread_index)
+	for (uint32_t frame = 0; frame < options.frame_count; ++frame)
 	{
-		Image const& image = images[thread_index];
-		for (int i = 0; i < pixel_count; ++i)
+		if (frame > 0)
 		{
-			final_image.pixels[i] += image.pixels[i];
+			float const angle = 2.f * 3.14159265358979323846f * frame / options.frame_count;
+			spin_vertices(scene, rest_vertices.data(), angle, vertices);
+			update_scene_geometry(scene, blases, built_sah_costs.data(), options, *build_pool);
 		}
-	}
-	for (int i = 0; i < pixel_count; ++i)
-	{
-		final_image.pixels[i] *= image_weight;
-	}
 
-	if (!write_rgbe("test.hdr", final_image))
-	{
-		fputs("Failed to write image\n", stderr);
-		return 1;
+		char image_path[32] = "test.hdr";
+		if (options.frame_count > 1)
+			snprintf(image_path, sizeof(image_path), "test_%03u.hdr", frame);
+		if (!render_frame(scene, options, *thread_pool, frame, blue_noise, image_path))
+		{
+			fputs("Failed to write image\n", stderr);
+			destroy_thread_pool(thread_pool);
+			destroy_thread_pool(build_pool);
+			delete[] blue_noise;
+			return 1;
+		}
 	}
 
+	destroy_thread_pool(thread_pool);
+	destroy_thread_pool(build_pool);
+	delete[] blue_noise;
+
 	return 0;
 }